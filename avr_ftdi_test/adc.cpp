@@ -0,0 +1,171 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "ftdi.h"
+#include "timing.h"
+#include "adc.h"
+
+// Sample bytes per packet, after the status bytes and the sample index
+#define ADC_PAYLOAD 60
+
+// Ping-pong buffers: the ISR fills buf[fill], the main loop ships buf[ship]
+static volatile uint8_t (*const buf)[ADC_PAYLOAD] = (volatile uint8_t (*)[ADC_PAYLOAD])FtdiPersonality::mode_ram;
+static_assert(FtdiPersonality::mode_ram_size >= 2 * ADC_PAYLOAD, "buffers don't fit");
+static volatile uint16_t first[2]; // index of the first sample of each buffer
+static volatile uint8_t full[2];
+static volatile uint8_t fill, pos;
+static uint8_t ship;
+
+static volatile uint16_t sample_index;
+static volatile uint8_t lost; // samples dropped since the last packet
+static volatile uint32_t samples, dropped;
+static uint16_t actual_rate;
+
+static uint8_t channel;
+
+ISR(ADC_vect)
+{
+	// The trigger is the rising edge of OCF1B, so clear it for the next one
+	TIFR1 = (1<<OCF1B);
+
+	uint8_t f = fill, p = pos;
+	uint16_t i = sample_index;
+
+	sample_index = i + 1;
+	samples++;
+
+	if (p == 0) {
+		if (full[f]) {
+			// Both buffers wait for the host
+			dropped++;
+			lost = 1;
+			return;
+		}
+		first[f] = i;
+	}
+
+	if (channel & ADC_8BIT) {
+		buf[f][p++] = ADCH;
+	} else {
+		buf[f][p++] = ADCL; // ADCL first, it locks ADCH
+		buf[f][p++] = ADCH;
+	}
+
+	if (p == ADC_PAYLOAD) {
+		full[f] = 1;
+		fill = f ^ 1;
+		p = 0;
+	}
+	pos = p;
+}
+
+void adc_config(uint8_t ch)
+{
+	channel = ch;
+}
+
+void adc_start(uint16_t rate)
+{
+	ADCSRA = 0;
+	TIMSK1 = 0;
+
+	uint16_t max = (channel & ADC_8BIT) ? ADC_MAX_RATE_8BIT : ADC_MAX_RATE_10BIT;
+	if (!rate)
+		rate = 1000;
+	if (rate > max)
+		rate = max;
+
+	fill = ship = pos = 0;
+	full[0] = full[1] = 0;
+	sample_index = 0;
+	lost = 0;
+	samples = dropped = 0;
+
+	// Timer1: CTC mode with TOP = OCR1A, compare match B at 0 triggers the ADC
+	uint32_t ticks = F_CPU / rate;
+	uint8_t cs = (1<<CS10);
+	uint8_t shift = 0;
+	if (ticks > 65536) {
+		cs = (1<<CS11); // clk/8
+		shift = 3;
+		if ((ticks >> 3) > 65536) {
+			cs = (1<<CS11) | (1<<CS10); // clk/64
+			shift = 6;
+		}
+	}
+	ticks >>= shift;
+	if (ticks > 65536)
+		ticks = 65536;
+	actual_rate = (F_CPU >> shift) / ticks;
+
+	TCCR1B = 0;
+	TCCR1A = 0;
+	TCNT1 = 0;
+	OCR1A = ticks - 1;
+	OCR1B = 0;
+	TIFR1 = (1<<OCF1B);
+
+	// AVcc reference, 8-bit samples left adjusted so ADCH is enough
+	ADMUX = (1<<REFS0) | ((channel & ADC_8BIT) ? (1<<ADLAR) : 0) | (channel & 0x1f);
+	ADCSRB = ((channel & 0x20) ? (1<<MUX5) : 0) | (1<<ADTS2) | (1<<ADTS0);
+	// ADC clock 1 MHz (8-bit) or 125 kHz (10-bit), auto trigger, interrupt
+	ADCSRA = (1<<ADEN) | (1<<ADATE) | (1<<ADIE) | (1<<ADIF)
+		| ((channel & ADC_8BIT) ? (1<<ADPS2) : ((1<<ADPS2) | (1<<ADPS1) | (1<<ADPS0)));
+
+	TCCR1B = (1<<WGM12) | cs;
+}
+
+void adc_stop(void)
+{
+	ADCSRA = (1<<ADIF);
+	TCCR1B = 0;
+	OCR1A = 0;
+
+	// Give Timer1 back (does nothing in Release builds)
+	timing_init();
+}
+
+void adc_get(adc_counters *out)
+{
+	uint8_t sreg = SREG;
+	cli();
+	out->samples = samples;
+	out->dropped = dropped;
+	SREG = sreg;
+	out->rate = actual_rate;
+}
+
+void adc_service(void)
+{
+	// Whatever the host sends is ignored
+	EP_select(FtdiConfig::ep_out);
+	if (Reg_UEINTX::any<_BV(RXOUTI)>())
+		Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+
+	EP_select(FtdiConfig::ep_in);
+
+	if (!full[ship] || !Reg_UEINTX::any<_BV(TXINI)>())
+		return;
+
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t l = lost;
+	lost = 0;
+	SREG = sreg;
+
+	UEDATX = 0x80; // Modem status.
+	UEDATX = l ? FTDI_LSR_OE : 0; // Line status.
+
+	uint16_t i = first[ship];
+	UEDATX = i & 0xff;
+	UEDATX = i >> 8;
+
+	volatile uint8_t *p = buf[ship];
+	for (uint8_t n = ADC_PAYLOAD; n; n--)
+		UEDATX = *p++;
+
+	Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+	full[ship] = 0;
+	ship ^= 1;
+}
@@ -0,0 +1,58 @@
+#ifndef ADC_H
+#define ADC_H
+
+// Continuous ADC sampling, streamed on EP1.
+//
+// Configured with FW_REQ_ADC_CONFIG (wValue = channel | ADC_8BIT) and started
+// with FW_REQ_SET_MODE (wValue = ftdi_mode_adc, wIndex = sample rate [Hz]).
+// Timer1 triggers the conversions (compare match B, auto trigger) at the
+// requested rate and the ADC interrupt writes the samples into two ping-pong
+// buffers. A full buffer goes to the host as one full 64 byte packet:
+//
+//   0x80, line status     the usual FTDI status bytes, FTDI_LSR_OE set when
+//                         samples were dropped since the previous packet
+//   index (2 bytes, LE)   number of the first sample, counting every
+//                         conversion, so a gap shows exactly what was lost
+//   60 bytes              60 8-bit samples or 30 10-bit samples (LE)
+//
+// Samples are dropped (and counted) when both buffers wait for the host.
+// The counters are read with FW_REQ_GET_ADC.
+//
+// NOTE: the mode takes over Timer1, so the timing histograms (Debug builds)
+// are meaningless while it runs and are cleared when it stops.
+
+#include <stdint.h>
+
+// Channel value: MUX5..0 of the datasheet (0, 1, 4..7 single ended ADC0..7,
+// 0x20..0x25 ADC8..13, 0x27 temperature sensor), or'ed with ADC_8BIT for
+// 8-bit samples (ADCH only, allows a faster ADC clock)
+#define ADC_8BIT 0x80
+
+// Highest sample rates [Hz]: 13 ADC clocks of 125 kHz (10-bit) and 1 MHz (8-bit)
+#define ADC_MAX_RATE_10BIT 9000
+#define ADC_MAX_RATE_8BIT 50000
+
+// Counters, as sent to the host (little endian)
+typedef struct
+{
+	uint32_t samples; // conversions since the mode was started
+	uint32_t dropped; // samples lost because both buffers were full
+	uint16_t rate; // [Hz] actually used
+} __attribute__((packed)) adc_counters;
+
+// Selects the channel and sample size for the next adc_start()
+void adc_config(uint8_t channel);
+
+// Starts sampling at `rate` Hz (0: 1000 Hz)
+void adc_start(uint16_t rate);
+
+// Stops the ADC and gives Timer1 back to the timing histograms
+void adc_stop(void);
+
+// Copies the counters
+void adc_get(adc_counters *out);
+
+// Main loop work: full buffers -> EP1
+void adc_service(void);
+
+#endif // ADC_H
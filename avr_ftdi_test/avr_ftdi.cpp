@@ -13,14 +13,13 @@
 //
 //  It sets up the Atmel USB peripheral to match a FT232BM style device.
 //  When running and connected to a pc/laptop running your favorite terminal
-//  software, some of the chars typed on the pc/laptop will be echoed back.
-//  Typing the 'a' character will print a rather famous message.
+//  software, the chars typed on the pc/laptop are sent out on the regular
+//  USART (TXD1) and the chars received on RXD1 show up in the terminal.
 //
 // What it is NOT:
 //  This will not give you a fully working USB to serial converter like the real 
 //  FT232BM chip does.
-//  No attempt has been made to ensure correct forwarding of bytes across interfaces
-//  etc. In fact, there are even characters mixed into the regular USART stream
+//  In fact, there are even characters mixed into the regular USART stream
 //  to aid debugging the USB enumeration process!
 //  Also note that only a minimal/limited set of the official vendor specific commands are
 //  responded to.
@@ -47,16 +46,13 @@
 // 1. Only tested on Arduino Leonardo board with 16 MHz crystal/oscillator
 // 2. The real FTDI has a EP0 size of 8 bytes, this program uses 64.
 //    Makes it easier to program the Atmel that way.
-// 3. The character echoed back is only the last character when a bunch of characters
-//    is actually received in one transaction. This is to keep the example simple.
-//    A more useful program will need some kind of line buffer, FIFO etc.
-//    Your turn to experiment!
+// 3. Bytes from the pc/laptop share the USART transmit ring with the debug output.
 // 4. Any USB power management / suspend related events/interrupts have not been
 //    taken into consideration. Things might break if you surprise remove the device!
 // 5. A number of vendor (FTDI) specific commands are acknowledged to keep the 
 //    original drivers happy, but are simply ignored.
-//    For instance setting the baud rate has no effect at all.
-//    Don't expect the regular USART peripheral to change settings based on these.
+//    The baud rate reaches the regular USART (and sets the bit bang rate), but
+//    don't expect it to change data bits, parity or flow control (SET_DATA, SET_FLOW_CTRL).
 // 6. FTDI EEPROM reads always give an output of all FF FF hex for the same reason.
 // 7. Unlike the original simple usb program, the file has turned half into C++, not C,
 //    which might annoy or offend some programmers. Sorry!
@@ -65,63 +61,40 @@
 #include <avr/io.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <avr/delay.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
 #include "uart.h"
+#include "fmt.h"
 #include "usb.h"
+#include "usb_device.h"
+#include "ftdi.h"
+#include "bench.h"
+#include "bitbang.h"
+#include "mpsse.h"
+#include "i2c.h"
+#include "adc.h"
+#include "la.h"
+#include "gen.h"
+#include "tick.h"
+#include "timing.h"
 
-// Variable to store incoming byte received from the regular USART
-static unsigned char uart_byte = 0;
 
-static
-uint8_t ctrl_write_PM(const void *addr, uint16_t len);
-
-#define set_bit(REG, BIT) REG |= _BV(BIT)
-#define clear_bit(REG, BIT) REG &= ~_BV(BIT)
-#define toggle_bit(REG, BIT) REG ^= _BV(BIT)
-#define assign_bit(REG, BIT, VAL) do{if(VAL) set_bit(REG,BIT) else clear_bit(REG,BIT);}while(0)
-
-// Endpoint 0 size
-// NOTE: FTDI defines this as 8 bytes instead, but 64 is much easier to program as we don't have
-// split up the bigger transfers.
-#define EP0_SIZE 64 
-
-#define EP_select(N) do{UENUM = (N)&0x07;}while(0)
-#define EP_read8() (UEDATX)
-#define EP_read16_le() ({uint16_t L, H; L=UEDATX; H=UEDATX; (H<<8)|L;})
-#define EP_write8(V) do{UEDATX = (V);}while(0)
-#define EP_write16_le(V) do{UEDATX=(V)&0xff;UEDATX=((V)>>8)&0xff;}while(0)
-
-	
 ISR(WDT_vect)
 {
 	
 }
 
-ISR(USART1_RX_vect)
-{
-	uart_byte=UDR1;
-}
-
-void oops(int a, char * v)
+void oops(int a, PGM_P v)
 {	
 	if (!a) {
-		printf_P(PSTR("oops! %s"),v);
+		put_str_P(PSTR("oops! "));
+		put_str_P(v);
 		while (1)
 			;
 	}
 }
 
-void put_hex(unsigned int i)
-{	
-	printf_P(PSTR("%04x"),i);
-}
-
-
-/* The control request currently being processed */
-
-static usb_header head;
 
 /* USB descriptors, stored in flash */
 static const usb_std_device_desc PROGMEM devdesc = {
@@ -131,7 +104,7 @@ static const usb_std_device_desc PROGMEM devdesc = {
     0x00, /* vendor specific / device class */
     0x00, /* vendor specific / device sub class */
     0x00, /* vendor specific / device protocol */
-    EP0_SIZE, /* EP 0 size 64 bytes, real FTID reports 8 */
+    FtdiConfig::ep0_size, /* EP 0 size 64 bytes, real FTID reports 8 */
     0x0403, // Vendor ID (VID): Future Technology Devices International Limited
     0x6001, // Product ID (PID): FT232
     0x0400, // bcdDevice
@@ -178,7 +151,7 @@ static const PROGMEM tdevconf devconf {
 		usb_desc_EP,
 		0x81, // address
 		0x02, // bulk
-		0x0040, // max packet size (64 bytes)
+		FtdiConfig::bulk_size, // max packet size (64 bytes)
 		0, // interval		
 	},
 	// End point 2
@@ -187,7 +160,7 @@ static const PROGMEM tdevconf devconf {
 		usb_desc_EP,
 		0x02, // address
 		0x02, // bulk
-		0x0040, // max packet size (64 bytes)
+		FtdiConfig::bulk_size, // max packet size (64 bytes)
 		0, // interval
 	}
 };
@@ -220,643 +193,734 @@ static const usb_std_string_desc iSerial PROGMEM = DESCSTR(L"FTP1W65N\0\0");
 
 #undef DESCSTR
 
-/* Handle the standard Get Descriptor request.
+/* Look up a descriptor in flash.
  * Return 1 on success
  */
-static
-uint8_t USB_get_desc(void)
+uint8_t FtdiPersonality::get_desc(uint8_t type, uint8_t idx, const void **addr, uint8_t *len)
 {
-    const void *addr;
-    uint8_t len, idx = head.wValue;
-    switch(head.wValue>>8)
+    switch(type)
     {
     case usb_desc_device:
         if(idx!=0) return 0;
-        addr = &devdesc; len = sizeof(devdesc);
+        *addr = &devdesc; *len = sizeof(devdesc);
         break;
     case usb_desc_config:
         if(idx!=0) return 0;
-        addr = &devconf; len = sizeof(devconf);
+        *addr = &devconf; *len = sizeof(devconf);
         break;
     case usb_desc_string:
         switch(idx)
         {
-        case 0: addr = &iLang; break;
-        case 1: addr = &iProd; break;
-        case 2: addr = &iSerial; break;
+        case 0: *addr = &iLang; break;
+        case 1: *addr = &iProd; break;
+        case 2: *addr = &iSerial; break;
         default: return 0;
         }
         /* the first byte of any descriptor is its length in bytes */
-        len = pgm_read_byte(addr);
+        *len = pgm_read_byte(*addr);
         break;
     default:
         return 0;
     }
-
-    if(len>head.wLength)
-        len = head.wLength;
-
-    return !ctrl_write_PM(addr, len);
+    return 1;
 }
 
-static void setupEP0(void);
-
 static uint16_t userval; /* user register */
 
-static inline void setupusb(void)
-{
-    /* disable USB interrupts and clear any active */
-    UDIEN = 0;
-    UDINT = 0;
-
-    set_bit(UDCON, DETACH); /* redundant? */
-
-    /* toggle USB reset */
-    clear_bit(USBCON, USBE);
-    set_bit(USBCON, USBE);
+// Still in the programming window after reset (see PROG_WINDOW_MS)
+static uint8_t prog_window = PROG_WINDOW_MS != 0;
 
-    /* No required.
-     * Gives some time to start reprogramming
-     * if previous program gets stuck right away
-     */
-    _delay_ms(1000);
-    putchar('.');
-
-    /* Unfreeze */
-    clear_bit(USBCON, FRZCLK);
-
-    /* setup PLL for 8 MHz system clock */
-    PLLCSR = 0;
-    set_bit(PLLCSR, PLLE);
-    loop_until_bit_is_set(PLLCSR, PLOCK);
-    putchar('.');
-
-    setupEP0(); /* configure control EP */
-    putchar('.');
-
-#ifdef HANDLE_SUSPEND
-    set_bit(UDIEN, SUSPE);
-#endif
-    set_bit(UDIEN, EORSTE);
-
-    /* allow host to un-stick us.
-     * Warning: Don't use w/ DETACH on CPU start
-     *          or a reset loop will result
-     */
-    //set_bit(UDCON, RSTCPU);
-    clear_bit(UDCON, DETACH);
-}
-
-/* Setup the control endpoint. (may be called from ISR) */
-static void setupEP0(void)
+// Restarts into the bootloader through a watchdog reset
+static void enter_bootloader(void)
 {
-    /* EPs assumed to be configured in increasing order */
-
-    EP_select(0);
-
-    /* un-configure EP 0 */
-    clear_bit(UECONX, EPEN);
-    clear_bit(UECFG1X, ALLOC);
-
-    /* configure EP 0 */
-    set_bit(UECONX, EPEN);
-    UECFG0X = 0; /* CONTROL */
-    UECFG1X = 0b00110010; // EPSIZE=64B, 1 bank, ALLOC 
-#if EP0_SIZE!=64
-#  error EP0 size mismatch
-#endif
-
-    if(bit_is_clear(UESTA0X, CFGOK)) {
-        putchar('!');
-        while(1) {} /* oops */
-    }
-}
-
-static void setup_other_ep()
-{
-	// The FTDI has two endpoints for serial data, they are:
-	//
-	// Endpoint 1 (IN):
-	//   bEndpointAddress:     0x81
-	//   Transfer Type:        Bulk
-	//   wMaxPacketSize:     0x0040 (64)
-	//   bInterval:            0x00
-	//
-	// Endpoint 2 (OUT):
-	//   bEndpointAddress:     0x02
-	//   Transfer Type:        Bulk
-	//   wMaxPacketSize:     0x0040 (64)
-	//   bInterval:            0x00
-
-    EP_select(1);
-
-    // un-configure EP 1
-    clear_bit(UECONX, EPEN);
-    clear_bit(UECFG1X, ALLOC);
-
-    // configure EP 1
-    set_bit(UECONX, EPEN);
-    UECFG0X = 0x81; // BULK, IN
-    UECFG1X = 0b00110010; // EPSIZE=64B, 1 bank, ALLOC
-
-	if(bit_is_clear(UESTA0X, CFGOK)) {
-		putchar('1!');
-		while(1) {} /* oops */
-	}
-
-    EP_select(2);
-
-    // un-configure EP 2
-    clear_bit(UECONX, EPEN);
-    clear_bit(UECFG1X, ALLOC);
-
-    // configure EP 2
-    set_bit(UECONX, EPEN);
-    UECFG0X = 0x80; /* BULK, OUT */
-    UECFG1X = 0b00110010; // EPSIZE=64B, 1 bank, ALLOC
-
-    if(bit_is_clear(UESTA0X, CFGOK)) {
-	    putchar('1!');
-	    while(1) {} /* oops */
-    }
-
-    EP_select(0);	
-	
+	cli();
+	*(volatile uint16_t *)BOOTKEY_ADDR = BOOTKEY;
+	wdt_enable(WDTO_15MS);
+	while (1)
+		;
 }
 
+// Only the top half runs with interrupts disabled, see UsbDevice<>::gen_isr()
 ISR(USB_GEN_vect, ISR_BLOCK)
 {
-    uint8_t status = UDINT, ack = 0;
-    putchar('I');
-#ifdef HANDLE_SUSPEND
-    if(bit_is_set(status, SUSPI))
-    {
-        ack |= _BV(SUSPI);
-        /* USB Suspend */
-
-        /* prepare for wakeup */
-        clear_bit(UDIEN, SUSPE);
-        set_bit(UDIEN, WAKEUPE);
-
-        set_bit(USBCON, FRZCLK); /* freeze */
-    }
-    if(bit_is_set(status, WAKEUPI))
-    {
-        ack |= _BV(WAKEUPI);
-        /* USB wakeup */
-        clear_bit(USBCON, FRZCLK); /* freeze */
-
-        clear_bit(UDIEN, WAKEUPE);
-        set_bit(UDIEN, SUSPE);
-    }
-#endif
-    if(bit_is_set(status, EORSTI))
-    {
-        ack |= _BV(EORSTI);
-        /* coming out of USB reset */
-
-#ifdef HANDLE_SUSPEND
-        clear_bit(UDIEN, SUSPE);
-        set_bit(UDIEN, WAKEUPE);
-#endif
-
-        putchar('E');
-        setupEP0();
-    }
-    /* ack. all active interrupts (write 0)
-     * (write 1 has no effect)
-     */
-    UDINT = ~ack;
+	Usb::gen_isr();
 }
 
-/* function to write bytes of program memory to a bulk endpoint 
-BUG/LIMITATION: this function does not allow writing big chunks, because
-the bulk endpoints in this program have a max size of 64 bytes */
-static
-void bulk_write_PM(const void *addr, uint16_t len)
+// Baud rate for the divisor of a SET_BAUD_RATE request: 3 MHz divided by
+// 14 integer bits (wValue 0..13) and a 3 bit fraction code (wValue 14..15,
+// wIndex 0) in eighths, with a peculiar encoding
+static uint32_t ftdi_baud(uint16_t value, uint16_t index)
 {
-    while(len--) {
-	    uint8_t val = pgm_read_byte(addr);
-		UEDATX = val;
-		addr++;
-    }	
+	static const uint8_t eighths[8] = { 0, 4, 2, 1, 3, 5, 6, 7 };
+	uint8_t code = (value >> 14) | ((index & 1) << 2);
+	uint32_t div8 = (uint32_t)(value & 0x3fff) * 8 + eighths[code];
+
+	// Divisors 0 and 1 are special
+	if (div8 == 0)
+		return 3000000;
+	if (div8 == 8)
+		return 2000000;
+	return (3000000UL * 8 + div8 / 2) / div8;
 }
 
+// Baud rate last set by the host
+static uint32_t host_baud = 9600;
 
-/* write value from flash to EP0 */
-static
-uint8_t ctrl_write_PM(const void *addr, uint16_t len)
+// Releases whatever the current mode uses, before another one is selected
+static void stop_mode(void)
 {
-
-    while(len) {
-        uint8_t ntx = EP0_SIZE,
-                bsize = UEBCLX,
-                epintreg = UEINTX;
-
-        oops(ntx>=bsize, "EP"); /* EP0_SIZE is wrong */
-
-        ntx -= bsize;
-        if(ntx>len)
-            ntx = len;
-
-        if(bit_is_set(epintreg, RXSTPI))
-            return 1; /* another SETUP has started, abort this one */
-        if(bit_is_set(epintreg, RXOUTI))
-            break; /* stop early? (len computed improperly?) */
-
-        /* Retry until can send */
-        if(bit_is_clear(epintreg, TXINI))
-            continue;
-        oops(ntx>0, "Ep"); /* EP0_SIZE is wrong (or logic error?) */
-
-        len -= ntx;
-
-        while(ntx) {
-            uint8_t val = pgm_read_byte(addr);
-            EP_write8(val);
-            addr++;
-            ntx--;
-        }
-
-        clear_bit(UEINTX, TXINI);
-    }
-    return 0;
-}
-
-/* Handle standard Set Address request */
-static
-void USB_set_address(void)
-{
-    UDADDR = head.wValue&0x7f;
-
-    clear_bit(UEINTX, TXINI); /* send 0 length reply */
-    loop_until_bit_is_set(UEINTX, TXINI); /* wait until sent */
-
-    UDADDR = _BV(ADDEN) | (head.wValue&0x7f);
-
-    clear_bit(UEINTX, TXINI); /* magic packet? */
-}
-
-static
-uint8_t USB_config;
-
-static
-void USB_set_config(void)
-{
-	USB_config = head.wValue;
-	
-	setup_other_ep();
-}
-
-// Called when we encounter an 'alien' USB request/message so we can work out what 
-// is needed to support it
-static void dump_unsupported_request(void)
-{
-	putchar('?');
-	put_hex(head.bmReqType);
-	put_hex(head.bReq);
-	put_hex(head.wLength>>8);
-	put_hex(head.wLength);	
-}
-
-// Handles CONTROL reads (Atmel to pc)
-static void usb_control_in(void)
-{	
-	// Flag that indicates whether the request was supported and should be ack'ed.
-	// If at the end of the function it is false, then a the endpoint is STALLed
-    uint8_t ok = 0; 
-
-    switch(head.bReq)
-    {
-    case usb_req_set_feature:
-    case usb_req_clear_feature:
-        /* No features to handle.
-         * We ignore Remote wakeup,
-         * and EP0 will never be Halted
-         */
-        ok = 1;
-        break;
-    case usb_req_get_status:
-        switch(head.bmReqType) {
-        case USB_REQ_TYPE_IN:
-        case USB_REQ_TYPE_IN | USB_REQ_TYPE_INTERFACE:
-        case USB_REQ_TYPE_IN | USB_REQ_TYPE_ENDPOINT:
-            // always status 0
-            loop_until_bit_is_set(UEINTX, TXINI);
-            EP_write16_le(0);
-            clear_bit(UEINTX, TXINI);
-            ok = 1;
-        }
-        break;
-    case usb_req_set_address:
-		// This is an 'out' command, so should be handled by 'usb_control_out' instead
-        break;
-    case usb_req_get_desc:
-        if(head.bmReqType==0x80) {
-            ok = USB_get_desc();
-        }
-        break;
-    case usb_req_set_config:
-        if(head.bmReqType==0) {
-            USB_config = head.wValue;
-            ok = 1;
-        }
-        break;
-    case usb_req_get_config:
-        if(head.bmReqType==USB_REQ_TYPE_IN) {
-            loop_until_bit_is_set(UEINTX, TXINI);
-            EP_write8(USB_config);
-            clear_bit(UEINTX, TXINI);
-            ok = 1;
-        }
-        break;
-    case usb_req_set_iface:
+	switch (FtdiPersonality::mode) {
+	case ftdi_mode_uart:
+		uart_set_gap(0);
 		break;
-    case usb_req_get_iface:
+	case ftdi_mode_bitbang:
+		bitbang_stop();
 		break;
-    case usb_req_set_desc:
+	case ftdi_mode_mpsse:
+		mpsse_stop();
 		break;
-    case usb_req_synch_frame:
-        break;
+	case ftdi_mode_i2c:
+		i2c_stop();
+		break;
+	case ftdi_mode_adc:
+		adc_stop();
+		break;
+	case ftdi_mode_la:
+		la_stop();
+		break;
+	case ftdi_mode_gen:
+		gen_stop();
+		break;
+	}
+}
 
-    default:
-		if ((head.bmReqType & USB_REQ_TYPE_VENDOR)==0) {
-			dump_unsupported_request();
-		}
-    }
+// Handles FTDI specific CONTROL reads (Atmel to pc)
+uint8_t FtdiPersonality::control_in(void)
+{
+	const usb_header &head = Usb::head;
+	uint8_t ok = 0;
 
-	// Vendor specific	
 	if (head.bmReqType == (USB_REQ_TYPE_IN|USB_REQ_TYPE_VENDOR)) {
 		switch (head.bReq) {
 		case FTDI_SIO_READ_EEPROM:
-			loop_until_bit_is_set(UEINTX, TXINI);
+			Reg_UEINTX::wait<_BV(TXINI)>();
 			EP_write8(0xff);
 			EP_write8(0xff);
-			clear_bit(UEINTX, TXINI);
+			Reg_UEINTX::clear<_BV(TXINI)>();
 			ok=1;
 		
 			break;
 
 		case FTDI_SIO_GET_LATENCY_TIMER:
-			// 16 ms is the default value
-			loop_until_bit_is_set(UEINTX, TXINI);
-			EP_write8(0x10); // 16 [ms] is the default value
-			clear_bit(UEINTX, TXINI);
+			Reg_UEINTX::wait<_BV(TXINI)>();
+			EP_write8(latency);
+			Reg_UEINTX::clear<_BV(TXINI)>();
 			ok=1;
 			break;
 		case FTDI_SIO_GET_MODEM_STATUS:
 			// 16 ms is the default value
-			loop_until_bit_is_set(UEINTX, TXINI);
+			Reg_UEINTX::wait<_BV(TXINI)>();
 			EP_write8(0x00); // 16 [ms] is the default value
-			clear_bit(UEINTX, TXINI);
+			Reg_UEINTX::clear<_BV(TXINI)>();
 			ok=1;
 			break;
+		case FTDI_SIO_READ_PINS:
+			Reg_UEINTX::wait<_BV(TXINI)>();
+			EP_write8(PINB);
+			Reg_UEINTX::clear<_BV(TXINI)>();
+			ok=1;
+			break;
+		case FW_REQ_GET_BENCH:
+			{
+				bench_counters c;
+				bench_get(&c);
+				Usb::ctrl_reply(&c, sizeof(c));
+				ok=1;
+			}
+			break;
+		case FW_REQ_GET_ADC:
+			{
+				adc_counters c;
+				adc_get(&c);
+				Usb::ctrl_reply(&c, sizeof(c));
+				ok=1;
+			}
+			break;
+		case FW_REQ_GET_LA:
+			{
+				la_counters c;
+				la_get(&c);
+				Usb::ctrl_reply(&c, sizeof(c));
+				ok=1;
+			}
+			break;
+		case FW_REQ_GET_GEN:
+			{
+				gen_counters c;
+				gen_get(&c);
+				Usb::ctrl_reply(&c, sizeof(c));
+				ok=1;
+			}
+			break;
+		case FW_REQ_GET_CRC:
+			Usb::ctrl_reply(&crc_count, sizeof(crc_count));
+			ok=1;
+			break;
+#ifdef ENABLE_TIMING
+		case FW_REQ_GET_TIMING:
+			{
+				timing_hist h;
+				if (timing_get(head.wIndex, &h)) {
+					uint16_t len = sizeof(h);
+					if (len > head.wLength)
+						len = head.wLength;
+					ok = !Usb::ctrl_write_RAM(&h, len);
+				}
+			}
+			break;
+#endif
 		default:
-			dump_unsupported_request();			
-		};	
-		
+			break;
+		};
 	}
-	
-    if(ok) {
-        if(head.bmReqType&ReqType_DirD2H) {
-            /* Control read.
-             * Wait for, and complete, status
-             */
-            uint8_t sts;
-            while(!((sts=UEINTX)&(_BV(RXSTPI)|_BV(RXOUTI)))) {}
-            //loop_until_bit_is_set(UEINTX, RXOUTI);
-            ok = (sts & _BV(RXOUTI));
-            if(!ok) {
-                set_bit(UECONX, STALLRQ);
-                putchar('S');
-            } else {
-                clear_bit(UEINTX, RXOUTI);
-                clear_bit(UEINTX, TXINI);
-            }
-        } else {
-            /* Control write.
-             * indicate completion
-             */
-            clear_bit(UEINTX, TXINI);
-        }
-        putchar('C');
-
-    } else {
-        /* fail un-handled SETUP */
-        set_bit(UECONX, STALLRQ);
-        putchar('F');
-    }
+	return ok;
 }
+	
 
-// Handles CONTROL writes (pc to Atmel)
-static void usb_control_out(void)
+// Handles FTDI specific CONTROL writes (pc to Atmel)
+uint8_t FtdiPersonality::control_out(void)
 {
+	const usb_header &head = Usb::head;
 	uint8_t ok = 0;
 
-    switch(head.bReq)
-    {
-    case usb_req_set_feature:
-    case usb_req_clear_feature:
-        /* No features to handle.
-         * We ignore Remote wakeup,
-         * and EP0 will never be Halted
-         */
-        ok = 1;
-        break;
-    case usb_req_get_status:
-		// This is an 'in' command, so should be handled by `usb_control_in` instead
-        break;
-    case usb_req_set_address:
-        if(head.bmReqType==USB_REQ_TYPE_OUT) {
-			// Host sets USB address
-            putchar('A');
-            USB_set_address();		
-            putchar('a');
-			
-            return;
-        }
-        break;
-    case usb_req_get_desc:
-		// This is an 'in' command, so should be handled by 'usb_control_in' instead
-        break;
-    case usb_req_set_config:
-        if(head.bmReqType==0) {
-			putchar('S');
-			USB_set_config();
-			putchar('s');			
-            ok = 1;					
-        }
-        break;
-    case usb_req_get_config:
-        break;
-    case usb_req_set_iface:
-		break;
-    case usb_req_get_iface:
-		break;
-    case usb_req_set_desc:
-		break;
-    case usb_req_synch_frame:
-        break;
-
-    default:
-		if ((head.bmReqType & USB_REQ_TYPE_VENDOR)==0) {
-			dump_unsupported_request();
-		}
-    }
-	
-	// Vendor specific
 	if (head.bmReqType == (USB_REQ_TYPE_OUT|USB_REQ_TYPE_VENDOR)) {
 		switch (head.bReq) {
 		case FTDI_SIO_RESET:
 			ok=1;
 			break;			
-		case FTDI_SIO_MODEM_CTRL:
 		case FTDI_SIO_SET_BAUD_RATE:
+			host_baud = ftdi_baud(head.wValue, head.wIndex);
+			// 1200 baud restarts into the bootloader in the programming window
+			if (prog_window && host_baud == 1200)
+				enter_bootloader();
+			// Timer3 belongs to the current mode, the rate only reaches it in bit bang mode
+			bitbang_set_baud(host_baud);
+			if (mode == ftdi_mode_bitbang)
+				bitbang_load_rate();
+			// The bridge runs at the host's rate, after the character on the line.
+			// Polling starts over, only if the new rate is fast enough for it.
+			if (mode == ftdi_mode_uart) {
+				USART_SetBaud(host_baud);
+				rx_polled = 0;
+				tx_polled = 0;
+			}
+			ok=1;
+			break;
+		case FTDI_SIO_SET_BITMODE:
+			switch (head.wValue >> 8) {
+			case FTDI_BITMODE_RESET:
+				stop_mode();
+				// The rate may have changed while another mode ran
+				if (mode != ftdi_mode_uart) {
+					USART_SetBaud(host_baud);
+					rx_polled = 0;
+					tx_polled = 0;
+				}
+				framing_start();
+				mode = ftdi_mode_uart;
+				ok=1;
+				break;
+			case FTDI_BITMODE_BITBANG:
+			case FTDI_BITMODE_SYNCBB:
+				stop_mode();
+				bitbang_set_baud(host_baud);
+				bitbang_start(head.wValue >> 8, head.wValue & 0xff);
+				mode = ftdi_mode_bitbang;
+				ok=1;
+				break;
+			case FTDI_BITMODE_MPSSE:
+				stop_mode();
+				mpsse_start();
+				mode = ftdi_mode_mpsse;
+				ok=1;
+				break;
+			}
+			break;
+		case FTDI_SIO_MODEM_CTRL:
 		case FTDI_SIO_SET_DATA:
 		case FTDI_SIO_SET_FLOW_CTRL:
+			ok=1;
+			break;
 		case FTDI_SIO_SET_LATENCY_TIMER:
+			latency = head.wValue;
+			ok=1;
+			break;
+		case FW_REQ_SET_RS485:
+			uart_set_rs485(head.wIndex & 1, head.wValue & 0xff, head.wValue >> 8);
+			tx_polled = 0;
+			ok=1;
+			break;
+		case FW_REQ_SET_9BIT:
+			uart_set_9bit(head.wIndex & 1, head.wValue & 0xff, head.wValue >> 8);
+			tx_esc = 0;
+			rx_polled = 0;
+			tx_polled = 0;
+			if (mode == ftdi_mode_uart)
+				framing_start();
+			ok=1;
+			break;
+		case FW_REQ_SET_CRC:
+			crc_rx = head.wValue & 0xff;
+			crc_tx = head.wValue >> 8;
+			if (crc_rx > CRC_8)
+				crc_rx = CRC_NONE;
+			if (crc_tx > CRC_8)
+				crc_tx = CRC_NONE;
+			crc_discard = head.wIndex & 1;
+			crc_count = crc_counters();
+			tx_crc = crc_start(crc_tx);
+			tx_frame = 0;
+			tx_polled = 0;
+			if (mode == ftdi_mode_uart)
+				framing_start();
+			ok=1;
+			break;
+		case FW_REQ_SET_FRAMING:
+			frame_gap = head.wValue;
+			if (mode == ftdi_mode_uart)
+				framing_start();
+			ok=1;
+			break;
+		case FW_REQ_SET_MODE:
+			switch (head.wValue) {
+			case ftdi_mode_uart:
+				stop_mode();
+				framing_start();
+				mode = ftdi_mode_uart;
+				ok=1;
+				break;
+			case ftdi_mode_loopback:
+			case ftdi_mode_prbs_gen:
+			case ftdi_mode_prbs_check:
+				stop_mode();
+				bench_start(head.wIndex);
+				mode = head.wValue;
+				ok=1;
+				break;
+			case ftdi_mode_i2c:
+				stop_mode();
+				i2c_start(head.wIndex);
+				mode = ftdi_mode_i2c;
+				ok=1;
+				break;
+			case ftdi_mode_adc:
+				stop_mode();
+				adc_start(head.wIndex);
+				mode = ftdi_mode_adc;
+				ok=1;
+				break;
+			case ftdi_mode_la:
+				stop_mode();
+				la_start(head.wIndex);
+				mode = ftdi_mode_la;
+				ok=1;
+				break;
+			case ftdi_mode_gen:
+				stop_mode();
+				gen_start(head.wIndex);
+				mode = ftdi_mode_gen;
+				ok=1;
+				break;
+			}
+			break;
+		case FW_REQ_ADC_CONFIG:
+			adc_config(head.wValue);
+			ok=1;
+			break;
+		case FW_REQ_LA_CONFIG:
+			la_config(head.wValue & 0xff, head.wValue >> 8, head.wIndex);
+			ok=1;
+			break;
+		case FW_REQ_LA_TRIGGER:
+			la_trigger(head.wIndex, head.wValue & 0xff, head.wValue >> 8);
+			ok=1;
+			break;
+		case FW_REQ_GEN_CONFIG:
+			// Takes effect with the next start, not under the running ISR
+			gen_config(head.wValue & 0xff, head.wValue >> 8);
+			ok=1;
+			break;
+#ifdef ENABLE_TIMING
+		case FW_REQ_RESET_TIMING:
+			timing_reset();
 			ok=1;
 			break;
+#endif
 		default:
-			dump_unsupported_request();
-		};		
+			break;
+		};
 	}
+	return ok;
+}
 
-    if(ok) {
-        if(head.bmReqType&ReqType_DirD2H) {
-            /* Control read.
-             * Wait for, and complete, status
-             */
-            uint8_t sts;
-            while(!((sts=UEINTX)&(_BV(RXSTPI)|_BV(RXOUTI)))) {}
-            //loop_until_bit_is_set(UEINTX, RXOUTI);
-            ok = (sts & _BV(RXOUTI));
-            if(!ok) {
-                set_bit(UECONX, STALLRQ);
-                putchar('S');
-            } else {
-                clear_bit(UEINTX, RXOUTI);
-                clear_bit(UEINTX, TXINI);
-            }
-        } else {
-            /* Control write.
-             * indicate completion
-             */
-            clear_bit(UEINTX, TXINI);
-        }
-        putchar('C');
 
-    } else {
-        /* fail un-handled SETUP */
-        set_bit(UECONX, STALLRQ);
-        putchar('F');
-    }
-}
 
-// Whether we need to send Hello World message to the pc
-static bool do_send_famous_message = false;
-// Whether we need to echo a character to the pc
-static bool do_send_char = false;
-// Last usb "serial" character received as sent by pc/laptop
-static char usb_char = '\0';
+uint8_t FtdiPersonality::mode = ftdi_mode_uart;
+volatile uint8_t FtdiPersonality::mode_ram[FtdiPersonality::mode_ram_size];
+// 16 ms is the default value
+uint8_t FtdiPersonality::latency = 16;
+uint16_t FtdiPersonality::last_in;
+uint8_t FtdiPersonality::rx_polled;
+uint8_t FtdiPersonality::tx_polled;
+uint16_t FtdiPersonality::last_out;
+uint8_t FtdiPersonality::tx_esc;
+uint16_t FtdiPersonality::frame_gap;
+uint8_t FtdiPersonality::frame_end[ftdi_max_frames];
+uint8_t FtdiPersonality::frames;
+uint8_t FtdiPersonality::frame_short;
+uint8_t FtdiPersonality::frame_status[ftdi_max_frames];
+uint8_t FtdiPersonality::crc_rx;
+uint8_t FtdiPersonality::crc_tx;
+uint8_t FtdiPersonality::crc_discard;
+crc_counters FtdiPersonality::crc_count;
+uint16_t FtdiPersonality::rx_crc;
+uint8_t FtdiPersonality::crc_pos;
+uint8_t FtdiPersonality::crc_len;
+uint8_t FtdiPersonality::frame_sending;
+uint16_t FtdiPersonality::tx_crc;
+uint8_t FtdiPersonality::tx_taken;
+uint8_t FtdiPersonality::tx_frame;
+
+// Moves data between the bulk endpoints and whatever the current mode uses
+void FtdiPersonality::service(void)
+{
+	switch (mode) {
+	case ftdi_mode_loopback:
+		bench_loopback();
+		break;
+	case ftdi_mode_prbs_gen:
+		bench_prbs_gen();
+		break;
+	case ftdi_mode_prbs_check:
+		bench_prbs_check();
+		break;
+	case ftdi_mode_bitbang:
+		bitbang_service();
+		break;
+	case ftdi_mode_mpsse:
+		mpsse_service();
+		break;
+	case ftdi_mode_i2c:
+		i2c_service();
+		break;
+	case ftdi_mode_adc:
+		adc_service();
+		break;
+	case ftdi_mode_la:
+		la_service();
+		break;
+	case ftdi_mode_gen:
+		gen_service();
+		break;
+	default:
+		// Receive bytes from USB host (laptop/pc)
+		handle_incoming_bytes();
+
+		// Send bytes to USB host (laptop/pc)
+		handle_outgoing_bytes();
+	}
+}
 
 // Every FTDI serial read starts with two reserved bytes
-void send_reserved_bytes()
+void FtdiPersonality::send_reserved_bytes(uint8_t modem)
 {
+	// Fetch and clear the USART errors since the previous packet
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t err = uart_rx_errors;
+	uart_rx_errors = 0;
+	SREG = sreg;
+
 	// The original device reserves the first two bytes for the modem and line status
-	UEDATX = 0x80; // Modem status.
-	UEDATX = 0x00; // Line status.	
+	UEDATX = 0x80 | modem; // Modem status.
+	UEDATX = ((err & _BV(DOR1)) ? FTDI_LSR_OE : 0)
+		| ((err & _BV(UPE1)) ? FTDI_LSR_PE : 0)
+		| ((err & _BV(FE1)) ? FTDI_LSR_FE : 0); // Line status.
+}
+
+bool FtdiPersonality::in_packet_due(uint8_t n)
+{
+	return n >= ftdi_in_payload || (n && (uint16_t)(tick_now() - last_in) >= latency);
+}
+
+void FtdiPersonality::in_packet_sent(void)
+{
+	last_in = tick_now();
+}
+
+void FtdiPersonality::frame_pop(void)
+{
+	frames--;
+	for (uint8_t i = 0; i < frames; i++) {
+		frame_end[i] = frame_end[i + 1];
+		frame_status[i] = frame_status[i + 1];
+	}
+}
+
+void FtdiPersonality::check_advance(uint8_t to)
+{
+	uint8_t len = crc_len + (uint8_t)(to - crc_pos);
+
+	rx_crc = uart_rx_crc(rx_crc, crc_pos, to, crc_rx);
+	crc_len = len < crc_len ? 255 : len;
+	crc_pos = to;
+}
+
+uint8_t FtdiPersonality::check_frame(uint8_t end)
+{
+	check_advance(end);
+
+	uint8_t bad = crc_len <= crc_size(crc_rx) || rx_crc;
+	rx_crc = crc_start(crc_rx);
+	crc_len = 0;
+
+	if (!bad) {
+		crc_count.good++;
+		return 0;
+	}
+	crc_count.bad++;
+	return FTDI_MS_FRAME_BAD;
+}
+
+void FtdiPersonality::send_crc(void)
+{
+	USART_SendByte(tx_crc & 0xff);
+	if (crc_tx == CRC_MODBUS)
+		USART_SendByte(tx_crc >> 8);
+	crc_count.sent++;
+	tx_crc = crc_start(crc_tx);
+	tx_frame = 0;
+}
+
+void FtdiPersonality::framing_start(void)
+{
+	frames = 0;
+	frame_short = 0;
+	frame_sending = 0;
+	rx_polled = 0;
+	uart_set_gap(frame_gap);
+
+	// The bytes waiting in the ring start the first frame to check
+	crc_pos = uart_rx_head() - uart_available();
+	rx_crc = crc_start(crc_rx);
+	crc_len = 0;
 }
 
 // Possibly send bytes to the pc/laptop
-void handle_outgoing_bytes(void)
+void FtdiPersonality::handle_outgoing_bytes(void)
 {
+	TIMING_ENTER(TIMING_HANDLE_OUTGOING);
+
 	// Turn attention to the bulk IN endpoint, because that's were bytes
 	// destined for the pc/laptop should go to first
-	EP_select(1);
-	
-	if (do_send_famous_message) {
-		do_send_famous_message=false;
-		
-		if (bit_is_set(UEINTX,TXINI)) {
-			clear_bit(UEINTX,TXINI);
+	EP_select(FtdiConfig::ep_in);
+
+	// Framed mode: remember where the frame ended at every idle gap. When the
+	// host doesn't keep up, further frames are merged into the last one.
+	// With CRC checking a frame is held back until it is complete.
+	uint8_t check = frame_gap && !uart_9bit ? crc_rx : CRC_NONE;
+	uint8_t head = uart_rx_head();
+	uint8_t end;
+	while (frame_gap && uart_rx_gap(&end)) {
+		uint8_t status = FTDI_MS_FRAME_END;
+		if (check)
+			status |= check_frame(end);
+		if (frames == ftdi_max_frames)
+			status |= frame_status[--frames];
+		frame_status[frames] = status;
+		frame_end[frames++] = end;
+	}
+
+	if (check) {
+		// Bytes of the current frame, unless a gap after them came in meanwhile
+		if (uart_rx_before(head) > uart_rx_before(crc_pos))
+			check_advance(head);
+		// Too long to hold, pass it on
+		if (!frames && uart_rx_before(crc_pos) >= ftdi_rx_hold_max)
+			frame_sending = 1;
+	}
+
+	// Bad frames the host doesn't want never leave the ring
+	while (frames && crc_discard && !frame_sending && (frame_status[0] & FTDI_MS_FRAME_BAD)) {
+		uart_rx_skip(frame_end[0]);
+		crc_count.discarded++;
+		frame_pop();
+	}
+
+	// Fill a bank with as many received USART bytes as fit, but only send it once it
+	// is full or the latency timer expired. Packing up to 62 bytes per packet instead
+	// of one is what makes the IN direction fast.
+	if (Reg_UEINTX::any<_BV(TXINI)>()) {
+		uint8_t n = uart_available();
+		if (check)
+			n = frames ? uart_rx_before(frame_end[0]) : frame_sending ? uart_rx_before(crc_pos) : 0;
+
+		// Bytes pile up between two calls: sustained load, stop taking an
+		// interrupt per byte and poll the USART while filling the bank.
+		// Not in framed mode, the gap timer needs the interrupt, nor in 9-bit
+		// mode, where the interrupt escapes the ninth bit.
+		if (n >= ftdi_rx_poll_enter && uart_char_cycles <= UART_BURST_MAX_CHAR_CYCLES && !frame_gap
+			&& !uart_9bit)
+			rx_polled = 1;
+
+		if (frame_short) {
+			// A frame ended with a full packet, end the USB transfer too
 			send_reserved_bytes();
-			// Write the famous message to the pc/laptop
-			bulk_write_PM(PSTR("Hello world!\r\n"),14);			
-			clear_bit(UEINTX,FIFOCON);
-		}		
-	} else if (do_send_char) {
-		do_send_char=false;
-
-		if (bit_is_set(UEINTX,TXINI)) {
-			clear_bit(UEINTX,TXINI);			
+			Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+			frame_short = 0;
+			in_packet_sent();
+		} else if (frames && uart_rx_before(frame_end[0]) <= ftdi_in_payload) {
+			// The rest of a frame, send it right away and mark its end. A packet
+			// never holds bytes of two frames.
+			n = uart_rx_before(frame_end[0]);
+
+			send_reserved_bytes(frame_status[0]);
+			uart_drain_to(&UEDATX, n);
+			Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+
+			frame_short = n == ftdi_in_payload;
+			frame_sending = 0;
+			frame_pop();
+			in_packet_sent();
+		} else if (rx_polled) {
+			if (n || (UCSR1A & (1<<RXC1))) {
+				send_reserved_bytes();
+				// Back to interrupts once the line goes idle before the bank is full
+				TIMING_ENTER(TIMING_UART_RX_BURST);
+				if (uart_rx_burst(&UEDATX, ftdi_in_payload) < ftdi_in_payload)
+					rx_polled = 0;
+				TIMING_EXIT(TIMING_UART_RX_BURST);
+				Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+				in_packet_sent();
+			}
+		} else if (in_packet_due(n)) {
+			if (n > ftdi_in_payload)
+				n = ftdi_in_payload;
+
 			send_reserved_bytes();
-			// Send one char
-			UEDATX = usb_char;			
-			clear_bit(UEINTX,FIFOCON);		
+			uart_drain_to(&UEDATX, n);
+			// Acknowledge and send the bank in one go
+			Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+			if (check)
+				frame_sending = 1;
+
+			in_packet_sent();
 		}
 	}
-	
+
+	TIMING_EXIT(TIMING_HANDLE_OUTGOING);
+}
+
+// 9-bit mode: undoes the escaping of the OUT stream, a sequence may be split
+// over two packets
+void FtdiPersonality::send_escaped(uint8_t c)
+{
+	switch (tx_esc) {
+	case 0:
+		if (c == UART_9BIT_ESC)
+			tx_esc = 1;
+		else
+			USART_SendByte(c);
+		break;
+	case 1:
+		// Unknown sequences are dropped
+		tx_esc = c == UART_9BIT_ESC_ADDR ? 2 : 0;
+		if (c == UART_9BIT_ESC_FF)
+			USART_SendByte(UART_9BIT_ESC);
+		break;
+	default:
+		uart_send_address(c);
+		tx_esc = 0;
+		break;
+	}
 }
 
 // Possibly receive bytes from the pc/laptop
-void handle_incoming_bytes(void)
+void FtdiPersonality::handle_incoming_bytes(void)
 {
+	TIMING_ENTER(TIMING_HANDLE_INCOMING);
+
 	// Turn attention to the bulk OUT endpoint, because that's were bytes
 	// sent from the pc/laptop end up in.
-	EP_select(2);
+	EP_select(FtdiConfig::ep_out);
 	
-	if (bit_is_set(UEINTX, RXOUTI)) {
-		// Acknowledge receive int
-		clear_bit(UEINTX, RXOUTI);
-			
-		// See how much bytes we got
-		unsigned int N = ((unsigned int)UEBCHX << 8) | UEBCLX;
-		
-		if (N>0) {
-			// Read chars sent by the pc/laptop
-			for (int i(0);i<N;i++) {
-				usb_char = UEDATX;
-				
-				if (usb_char=='a')
-					do_send_famous_message=true;
-				else
-					do_send_char=true;					
+	if (Reg_UEINTX::any<_BV(RXOUTI)>()) {
+		// See how much bytes are (still) in the bank, only take what fits in the
+		// USART transmit ring. The rest stays put and is picked up by a later call,
+		// meanwhile the host gets NAKed.
+		uint8_t n = UEBCLX;
+		uint8_t room = uart_tx_free();
+		uint8_t append = uart_9bit ? CRC_NONE : crc_tx;
+
+		// A short packet ends the frame. Keep room for its CRC before taking
+		// the last bytes, so send_crc never waits for the ring.
+		uint8_t reserve = 0;
+		if (append && (uint8_t)(tx_taken + n) < FtdiConfig::bulk_size && (tx_frame || n))
+			reserve = crc_size(append);
+		uint8_t fits = room >= reserve;
+		room = fits ? room - reserve : 0;
+
+		// The host sends faster than the ring drains: sustained load, write the
+		// USART directly instead of taking an interrupt per byte. Not with RS-485
+		// driver enable control, which needs the transmit complete interrupt,
+		// nor in 9-bit mode or while appending CRCs.
+		if (n > room && uart_char_cycles <= UART_BURST_MAX_CHAR_CYCLES && !uart_rs485 && !uart_9bit
+			&& !append)
+			tx_polled = 1;
+		last_out = tick_now();
+
+		if (tx_polled) {
+			TIMING_ENTER(TIMING_UART_TX_BURST);
+			uart_tx_burst(&UEDATX, n);
+			TIMING_EXIT(TIMING_UART_TX_BURST);
+		} else {
+			if (n > room)
+				n = room;
+
+			// Send chars sent by the pc/laptop out on the regular USART. Escaped
+			// they never take more room than they came in.
+			if (uart_9bit) {
+				while (n--)
+					send_escaped(UEDATX);
+			} else if (append) {
+				tx_taken += n;
+				if (n)
+					tx_frame = 1;
+				while (n--) {
+					uint8_t c = UEDATX;
+					tx_crc = crc_update(append, tx_crc, c);
+					USART_SendByte(c);
+				}
+			} else {
+				while (n--)
+					USART_SendByte(UEDATX);
 			}
 		}
-		
-		clear_bit(UEINTX,FIFOCON);
-	}	
-}
 
-// Called when the pc/laptop is quizzing/configuring the Atmel
-static
-void handle_CONTROL(void)
-{
-    uint8_t ok = 0;
-    /* SETUP message */
-    head.bmReqType = EP_read8();
-    head.bReq = EP_read8();
-    head.wValue = EP_read16_le();
-    head.wIndex = EP_read16_le();
-    head.wLength = EP_read16_le();
-
-    /* ack. first stage of CONTROL.
-     * Clears buffer for IN/OUT data
-     */
-    clear_bit(UEINTX, RXSTPI);
-
-    /* despite what the figure in
-     * 21.12.2 (Control Read) would suggest,
-     * SW should not clear TXINI here
-     * as doing so will send a zero length
-     * response.
-     */
-	
-	if (head.bmReqType & USB_REQ_TYPE_IN)
-		usb_control_in();
-	else
-		usb_control_out();	
+		// Acknowledge receive int and free the bank in one go, once it is empty
+		if (UEBCLX == 0 && fits) {
+			// A short packet ends the transfer, and with it the frame
+			if (reserve)
+				send_crc();
+			tx_taken = 0;
+			Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+		}
+	} else if (tx_polled && (uint16_t)(tick_now() - last_out) >= ftdi_tx_poll_exit) {
+		// Idle, back to the interrupt driven ring
+		tx_polled = 0;
+	}
+
+	TIMING_EXIT(TIMING_HANDLE_INCOMING);
 }
 
 ISR(USB_COM_vect)
@@ -864,99 +928,63 @@ ISR(USB_COM_vect)
 	// This USB interrupt isn't used.
 }
 
-// Performs initial USB and PLL configuration
-void setup_usb()
-{
-	// Start with interrupts disabled
-	cli();
+enum ustate{usDisconnected, usDone};
 
-	// disable USB general interrupts
-	USBCON &= 0b11111110;
-	// disable all USB device interrupts
-	UDIEN &= 0b10000010;
-	// disable USB endpoint interrupts
-	UEIENX &= 0b00100000;
+int main(void)
+{
+	// A watchdog reset leaves the watchdog running, stop it before it fires again
+	MCUSR &= ~(1<<WDRF);
+	wdt_disable();
 
-	// Re-enable interrupts
-	sei();
+	// Timer1 starts counting here, the boot figures are relative to this point
+	timing_init();
 
-	// Enable USB pad regulator
-	UHWCON |= (1<<UVREGE);
-
-	// Configure PLL (setup 48 MHz USB clock)
-	PLLCSR = 0;
-	// Set PINDIV because we are using 16 MHz crystal
-	PLLCSR |= (1<<PINDIV);
-	// Configure 96MHz PLL output (is then divided by 2 to get 48 MHz USB clock)
-	PLLFRQ = (1<<PDIV3) | (1<<PDIV1) | (1<<PLLUSB) | (1 << PLLTM0);
-	// Enable PLL
-	PLLCSR |= (1<<PLLE);
-	
-	// Wait for PLL lock
-	while (!(PLLCSR & (1<<PLOCK)))
-		;
-			
-	// Enable USB
-	USBCON |= (1<<USBE)|(1<<OTGPADE);
-	// Clear freeze clock bit
-	USBCON &= ~(1<<FRZCLK);
-	
-	// configure USB interface (speed, endpoints, etc.)
-	UDCON &= ~(1 << LSM);     // full speed 12 Mbit/s
+	DDRC = 0x80;
 	
-	// disable rest of endpoints
-	for (uint8_t i = 1; i <= 6; i++) {
-		UENUM = (UENUM & 0xF8) | i;   // select endpoint i
-		UECONX &= ~(1 << EPEN);
-	}	
-}
+	USART_Init(USART_BAUDRATE);
 
-enum ustate{usDisconnected, usDone};
+	// Start the 1 ms tick (Timer0)
+	tick_init();
 
-int main(void)
-{
 	// Enable interrupts
-	USBCON=0;
-
 	sei();
-	
-	DDRC = 0x80;
-	
-	USART_Init();
 
+#ifdef ENABLE_CONSOLE
 	// Print startup message
-	printf_P(PSTR("Reboot!\r\n"));
+	put_str_P(PSTR("Reboot!\r\n"));
+#endif
 
 	// Configure PLL, USB
-	setup_usb();
-
-	unsigned int loop_ctr(0);
+	TIMING_ENTER(TIMING_USB_INIT);
+	Usb::init();
+	TIMING_EXIT(TIMING_USB_INIT);
 
     ustate us(usDisconnected);
 
-    // Main loop
+    // Main loop, never blocks: control requests are handled the moment they
+    // arrive, which is what keeps enumeration fast
     while (1) 
     {
-			++loop_ctr;
-
 			// Blink the yellow LED on the Leonardo board,
 			// so we can tell the main loop is running or not.
-			if (loop_ctr&0x80)
-				set_bit(PORTC,PORTC7);
-			else		
-				clear_bit(PORTC,PORTC7);
-				
-			_delay_ms(5);
+			if (tick_now() & 0x200)
+				Reg_PORTC::set<_BV(PORTC7)>();
+			else
+				Reg_PORTC::clear<_BV(PORTC7)>();
+
+			// Close the programming window for good (tick_now() wraps around)
+			if (prog_window && tick_now() >= PROG_WINDOW_MS)
+				prog_window = 0;
 
 			switch (us) {
 			case usDisconnected:				
 				if ((USBSTA & (1 << VBUS))) {
-					printf_P(PSTR("Plugged in!\r\n"));
 					// connected
-					UDCON &= ~(1 << DETACH);
-				
-					//end of reset interrupts
-					UDIEN |= (1<<EORSTE);//enable the end of reset interrupt
+					Usb::attach();
+					TIMING_SINCE_INIT(TIMING_BOOT_TO_ATTACH);
+#ifdef ENABLE_CONSOLE
+					put_str_P(PSTR("Plugged in!\r\n"));
+#endif
 						
 					us = usDone;
 				}
@@ -966,21 +994,15 @@ int main(void)
 				// TODO / BUG: This condition never seems to be met, at least with my Arduino Leonardo board
 				if (!((USBSTA & (1 << VBUS)))) {
 					// we got disconnected from the pc/laptop
-					printf_P(PSTR("Disconnected!\r\n"));
+#ifdef ENABLE_CONSOLE
+					put_str_P(PSTR("Disconnected!\r\n"));
+#endif
 					us = usDisconnected;
 				}
 				break;				
 		}
 
-		// Handle USB control messages
-		EP_select(0);
-		if ((UEINTX & (1 << RXSTPI)))
-			handle_CONTROL();
-
-		// Receive bytes from USB host (laptop/pc)
-		handle_incoming_bytes();
-		
-		// Send bytes to USB host (laptop/pc)
-		handle_outgoing_bytes();
+		// Handle USB control messages and bulk data
+		Usb::poll();
     }
 }
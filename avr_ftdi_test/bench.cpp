@@ -0,0 +1,137 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <string.h>
+#include "ftdi.h"
+#include "bench.h"
+#include "tick.h"
+
+static bench_counters counters;
+static uint16_t start_tick;
+
+// PRBS state: the last `order` bits of the sequence
+static uint16_t prbs;
+static uint8_t prbs_order;
+// Bytes the checker still needs to lock onto the incoming stream
+static uint8_t sync_bytes;
+
+// Loopback ring, 8-bit indices wrap with LOOP_SIZE-1 as mask
+#define LOOP_SIZE 128
+static uint8_t loop_buf[LOOP_SIZE];
+static uint8_t loop_head, loop_tail;
+
+void bench_start(uint8_t order)
+{
+	memset(&counters, 0, sizeof(counters));
+	start_tick = tick_now();
+
+	prbs_order = (order == 7) ? 7 : 15;
+	prbs = (prbs_order == 7) ? 0x7f : 0x7fff; // any state but all zeros
+	sync_bytes = (prbs_order == 7) ? 1 : 2;
+
+	loop_head = loop_tail = 0;
+}
+
+void bench_get(bench_counters *out)
+{
+	*out = counters;
+	out->ticks = tick_now() - start_tick;
+}
+
+// Next 8 bits of the sequence, MSB first
+static uint8_t prbs_next(void)
+{
+	uint16_t s = prbs;
+	uint8_t out = 0;
+
+	for (uint8_t i = 8; i; i--) {
+		uint8_t bit;
+		if (prbs_order == 7)
+			bit = ((s >> 6) ^ (s >> 5)) & 1;
+		else
+			bit = ((s >> 14) ^ (s >> 13)) & 1;
+		s = (s << 1) | bit;
+		out = (out << 1) | bit;
+	}
+
+	prbs = s & ((prbs_order == 7) ? 0x7f : 0x7fff);
+	return out;
+}
+
+void bench_prbs_gen(void)
+{
+	EP_select(FtdiConfig::ep_in);
+
+	if (Reg_UEINTX::any<_BV(TXINI)>()) {
+		FtdiPersonality::send_reserved_bytes();
+		for (uint8_t i = ftdi_in_payload; i; i--)
+			UEDATX = prbs_next();
+		Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+		counters.bytes_in += ftdi_in_payload;
+	}
+}
+
+void bench_prbs_check(void)
+{
+	EP_select(FtdiConfig::ep_out);
+
+	if (Reg_UEINTX::any<_BV(RXOUTI)>()) {
+		uint8_t n = UEBCLX;
+		counters.bytes_out += n;
+
+		while (n--) {
+			uint8_t c = UEDATX;
+
+			if (sync_bytes) {
+				// The state of the generator is just its last output bits
+				sync_bytes--;
+				prbs = ((prbs << 8) | c) & ((prbs_order == 7) ? 0x7f : 0x7fff);
+				continue;
+			}
+
+			// Count the bits that differ from what we expected
+			for (uint8_t diff = c ^ prbs_next(); diff; diff &= diff - 1)
+				counters.bit_errors++;
+		}
+
+		Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+	}
+}
+
+void bench_loopback(void)
+{
+	// EP2 -> ring, only when the whole bank fits
+	EP_select(FtdiConfig::ep_out);
+
+	if (Reg_UEINTX::any<_BV(RXOUTI)>()) {
+		uint8_t n = UEBCLX;
+		uint8_t room = (loop_tail - loop_head - 1) & (LOOP_SIZE - 1);
+
+		if (n <= room) {
+			counters.bytes_out += n;
+			while (n--) {
+				loop_buf[loop_head] = UEDATX;
+				loop_head = (loop_head + 1) & (LOOP_SIZE - 1);
+			}
+			Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+		}
+	}
+
+	// ring -> EP1, as many bytes as a packet holds. Like the UART bridge, a
+	// short packet waits for the latency timer.
+	EP_select(FtdiConfig::ep_in);
+
+	uint8_t n = (loop_head - loop_tail) & (LOOP_SIZE - 1);
+	if (Reg_UEINTX::any<_BV(TXINI)>() && FtdiPersonality::in_packet_due(n)) {
+		if (n > ftdi_in_payload)
+			n = ftdi_in_payload;
+		counters.bytes_in += n;
+
+		FtdiPersonality::send_reserved_bytes();
+		while (n--) {
+			UEDATX = loop_buf[loop_tail];
+			loop_tail = (loop_tail + 1) & (LOOP_SIZE - 1);
+		}
+		Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+		FtdiPersonality::in_packet_sent();
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Benchmark modes of the bulk endpoints, the regular USART is bypassed.
+//
+// Selected with the FW_REQ_SET_MODE vendor request (wValue = ftdi_mode_loopback,
+// ftdi_mode_prbs_gen or ftdi_mode_prbs_check, wIndex = PRBS order 7 or 15).
+// They measure the raw USB throughput and firmware overhead, separately from
+// the USART:
+//
+//  loopback:   whatever arrives on EP2 goes back on EP1 (through a RAM ring),
+//              short packets after the latency timer like the UART bridge
+//  PRBS gen:   EP1 streams PRBS-7 or PRBS-15 data at maximum rate
+//  PRBS check: EP2 data is checked against PRBS-7 or PRBS-15 and bit errors
+//              are counted. The checker locks onto the stream with the first
+//              one (PRBS-7) or two (PRBS-15) bytes after the mode was selected.
+//
+// The PRBS bits are sent MSB first, the generators are x^7+x^6+1 and x^15+x^14+1.
+// The counters are read with the FW_REQ_GET_BENCH vendor request.
+
+#include <stdint.h>
+
+// Counters of the benchmark modes, as sent to the host (little endian)
+typedef struct
+{
+	uint32_t bytes_out; // bytes received from the host (EP2)
+	uint32_t bytes_in; // payload bytes sent to the host (EP1)
+	uint32_t bit_errors; // found by the PRBS checker
+	uint16_t ticks; // [ms] since the mode was selected, wraps after 65.5 s
+} __attribute__((packed)) bench_counters;
+
+// Clears the counters and (re)starts the PRBS generator/checker with `order` 7 or 15
+void bench_start(uint8_t order);
+
+// Copies the counters
+void bench_get(bench_counters *out);
+
+// Main loop work of the modes
+void bench_loopback(void);
+void bench_prbs_gen(void);
+void bench_prbs_check(void);
+
+#endif // BENCH_H
@@ -0,0 +1,155 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "ftdi.h"
+#include "bitbang.h"
+#include "timing.h"
+
+// Rings between the endpoints and the ISR, 8-bit indices wrap with BB_SIZE-1 as mask
+#define BB_SIZE 128
+static volatile uint8_t out_buf[BB_SIZE];
+static volatile uint8_t out_head, out_tail; // head written by the main loop, tail by the ISR
+static volatile uint8_t in_buf[BB_SIZE];
+static volatile uint8_t in_head, in_tail; // head written by the ISR, tail by the main loop
+
+static uint8_t sync_mode;
+static volatile uint8_t out_mask;
+static uint16_t period = F_CPU / BITBANG_MAX_RATE;
+
+// One output byte per period. With nothing to do the interrupt turns itself
+// off, bitbang_service turns it on again.
+ISR(TIMER3_COMPA_vect)
+{
+	TIMING_ENTER(TIMING_BITBANG_ISR);
+
+	uint8_t t = out_tail;
+
+	if (t == out_head) {
+		// Nothing to send, hold the pins
+		TIMSK3 = 0;
+		TIMING_EXIT(TIMING_BITBANG_ISR);
+		return;
+	}
+
+	if (sync_mode) {
+		uint8_t h = in_head;
+		if ((uint8_t)((h + 1) & (BB_SIZE - 1)) == in_tail) {
+			// Host isn't reading the samples, wait
+			TIMSK3 = 0;
+			TIMING_EXIT(TIMING_BITBANG_ISR);
+			return;
+		}
+		in_buf[h] = PINB;
+		in_head = (h + 1) & (BB_SIZE - 1);
+	}
+
+	// Inputs get their pull up off, like the high impedance FTDI inputs
+	PORTB = out_buf[t] & out_mask;
+	out_tail = (t + 1) & (BB_SIZE - 1);
+
+	TIMING_EXIT(TIMING_BITBANG_ISR);
+}
+
+void bitbang_start(uint8_t bitmode, uint8_t mask)
+{
+	TIMSK3 = 0;
+	out_head = out_tail = 0;
+	in_head = in_tail = 0;
+	sync_mode = bitmode == FTDI_BITMODE_SYNCBB;
+	out_mask = mask;
+
+	PORTB &= mask;
+	DDRB = mask;
+
+	// Timer3: CTC mode, no prescaler
+	TCCR3A = 0;
+	TCCR3B = (1<<WGM32) | (1<<CS30);
+	OCR3A = period - 1;
+	TCNT3 = 0;
+	TIFR3 = (1<<OCF3A);
+	// The interrupt goes on with the first bytes from EP2
+}
+
+void bitbang_stop(void)
+{
+	TIMSK3 = 0;
+	TCCR3B = 0;
+	DDRB = 0;
+	PORTB = 0;
+}
+
+void bitbang_set_baud(uint32_t baud)
+{
+	uint32_t rate = baud * 16;
+
+	if (rate > BITBANG_MAX_RATE || rate == 0)
+		rate = BITBANG_MAX_RATE;
+	uint32_t p = F_CPU / rate;
+	period = p > 0xffff ? 0xffff : p;
+}
+
+void bitbang_load_rate(void)
+{
+	// OCR3A isn't double buffered in CTC mode, so restart the period if the
+	// counter is past the new top already (or it would wrap first)
+	uint8_t sreg = SREG;
+	cli();
+	OCR3A = period - 1;
+	if (TCNT3 >= period)
+		TCNT3 = 0;
+	SREG = sreg;
+}
+
+void bitbang_service(void)
+{
+	// EP2 -> output ring, only when the whole bank fits
+	EP_select(FtdiConfig::ep_out);
+
+	if (Reg_UEINTX::any<_BV(RXOUTI)>()) {
+		uint8_t n = UEBCLX;
+		uint8_t h = out_head;
+		uint8_t room = (out_tail - h - 1) & (BB_SIZE - 1);
+
+		if (n <= room) {
+			while (n--) {
+				out_buf[h] = UEDATX;
+				h = (h + 1) & (BB_SIZE - 1);
+			}
+			out_head = h;
+			Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+		}
+	}
+
+	// Samples -> EP1 (synchronous mode only)
+	if (!sync_mode) {
+		if (out_head != out_tail)
+			TIMSK3 = (1<<OCIE3A);
+		return;
+	}
+
+	EP_select(FtdiConfig::ep_in);
+
+	if (Reg_UEINTX::any<_BV(TXINI)>()) {
+		uint8_t t = in_tail;
+		uint8_t n = (in_head - t) & (BB_SIZE - 1);
+
+		if (FtdiPersonality::in_packet_due(n)) {
+			if (n > ftdi_in_payload)
+				n = ftdi_in_payload;
+
+			FtdiPersonality::send_reserved_bytes();
+			while (n--) {
+				UEDATX = in_buf[t];
+				t = (t + 1) & (BB_SIZE - 1);
+			}
+			in_tail = t;
+			Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+			FtdiPersonality::in_packet_sent();
+		}
+	}
+
+	// Bytes to send and room for their samples
+	if (out_head != out_tail && (uint8_t)((in_head + 1) & (BB_SIZE - 1)) != in_tail)
+		TIMSK3 = (1<<OCIE3A);
+}
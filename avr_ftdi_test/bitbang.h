@@ -0,0 +1,46 @@
+#ifndef BITBANG_H
+#define BITBANG_H
+
+// FTDI bit bang modes on PORTB (Arduino Leonardo D8..D11, SCK/MOSI/MISO, RX LED).
+//
+// Selected with SET_BITMODE, the low byte of wValue is the direction mask
+// (1: output). Bytes arriving on EP2 are written to the port by the Timer3
+// compare ISR, one per period:
+//
+//  asynchronous: the bytes are clocked out, nothing is sent on EP1 (like the
+//                UART bridge, no status packets without data)
+//  synchronous:  the pins are sampled right before every output change and
+//                the samples go back on EP1, one for every byte written
+//
+// Like the FT232BM, the bytes go out at 16 times the baud rate set by the host
+// (SET_BAUD_RATE), but at most BITBANG_MAX_RATE, which is what the ISR and
+// the USB side can sustain. The port holds its last value when EP2 runs dry,
+// the timer interrupt is off until there is something to do again.
+// READ_PINS reads PINB in any mode.
+
+#include <stdint.h>
+
+// Highest byte rate [Hz]. The synchronous path of the ISR takes about 85
+// cycles including entry and exit (TIMING_BITBANG_ISR measures the body), so
+// at 256 cycles per byte it leaves two thirds of the CPU to the main loop,
+// which has to move the same bytes through EP2 and EP1.
+#define BITBANG_MAX_RATE 62500UL
+
+// Starts bit bang mode `bitmode` (FTDI_BITMODE_BITBANG or FTDI_BITMODE_SYNCBB)
+// with the pins in `mask` as outputs
+void bitbang_start(uint8_t bitmode, uint8_t mask);
+
+// Stops the timer and makes all pins inputs again
+void bitbang_stop(void);
+
+// Sets the output rate for the baud rate `baud` the host asked for, used by
+// the next bitbang_start. Timer3 is left alone, other modes use it too.
+void bitbang_set_baud(uint32_t baud);
+
+// Loads the output rate into the running timer, in bit bang mode only
+void bitbang_load_rate(void);
+
+// Main loop work: EP2 -> output ring, input ring -> EP1
+void bitbang_service(void);
+
+#endif // BITBANG_H
@@ -0,0 +1,56 @@
+#ifndef CRC_H
+#define CRC_H
+
+// Table driven CRCs for framed mode, one table lookup per byte. Both are used
+// without a final xor, so the CRC over a frame including its own CRC (as sent
+// on the wire) is 0 when the frame is intact.
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC types (FW_REQ_SET_CRC)
+#define CRC_NONE 0
+#define CRC_MODBUS 1 // CRC-16/MODBUS: poly 0x8005 reflected, init 0xffff, sent low byte first
+#define CRC_8 2 // CRC-8/SMBUS: poly 0x07, init 0
+
+// Framed mode CRC counters, as sent to the host (little endian)
+typedef struct
+{
+	uint16_t good; // received frames with a correct CRC
+	uint16_t bad; // received frames with a wrong CRC, or too short for one
+	uint16_t discarded; // bad frames that never reached the host
+	uint16_t sent; // CRCs appended to transmitted frames
+} __attribute__((packed)) crc_counters;
+
+extern const uint16_t crc16_modbus_table[256] PROGMEM;
+extern const uint8_t crc8_table[256] PROGMEM;
+
+// Initial value
+static inline uint16_t crc_start(uint8_t type)
+{
+	return type == CRC_MODBUS ? 0xffff : 0;
+}
+
+// Number of CRC bytes at the end of a frame
+static inline uint8_t crc_size(uint8_t type)
+{
+	return type == CRC_MODBUS ? 2 : type == CRC_8 ? 1 : 0;
+}
+
+// Shifts byte `c` through the CRC
+static inline uint16_t crc_update(uint8_t type, uint16_t crc, uint8_t c)
+{
+	if (type == CRC_MODBUS)
+		return (crc >> 8) ^ pgm_read_word(&crc16_modbus_table[(uint8_t)crc ^ c]);
+	return pgm_read_byte(&crc8_table[(uint8_t)crc ^ c]);
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // CRC_H
@@ -0,0 +1,65 @@
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "settings.h"
+#include "uart.h"
+#include "fmt.h"
+
+void put_char(char c)
+{
+#ifdef ENABLE_CONSOLE
+	USART_SendByte(c);
+#endif
+}
+
+void put_str(const char *s)
+{
+	while (*s)
+		put_char(*s++);
+}
+
+void put_str_P(PGM_P s)
+{
+	char c;
+	while ((c = pgm_read_byte(s++)))
+		put_char(c);
+}
+
+static void put_nibble(uint8_t v)
+{
+	v &= 0x0f;
+	put_char(v < 10 ? '0' + v : 'a' - 10 + v);
+}
+
+void put_hex8(uint8_t v)
+{
+	put_nibble(v >> 4);
+	put_nibble(v);
+}
+
+void put_hex16(uint16_t v)
+{
+	put_hex8(v >> 8);
+	put_hex8(v);
+}
+
+// The AVR has no divide instruction, so digits are found by repeated subtraction
+static const uint16_t powers_of_ten[] PROGMEM = { 10000, 1000, 100, 10 };
+
+void put_dec(uint16_t v)
+{
+	uint8_t started = 0;
+
+	for (uint8_t i = 0; i < sizeof(powers_of_ten)/sizeof(powers_of_ten[0]); i++) {
+		uint16_t p = pgm_read_word(&powers_of_ten[i]);
+		char digit = '0';
+		while (v >= p) {
+			v -= p;
+			digit++;
+		}
+		if (started || digit != '0') {
+			put_char(digit);
+			started = 1;
+		}
+	}
+	put_char('0' + v);
+}
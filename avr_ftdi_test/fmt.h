@@ -0,0 +1,38 @@
+#ifndef FMT_H
+#define FMT_H
+
+// Small dedicated emitters for debug output on the regular USART.
+//
+// These replace printf_P, which drags avr-libc's vfprintf (several KB of flash)
+// into the firmware and costs hundreds of cycles per call. Every emitter ends
+// up in put_char(), so all of them share the same output path. Without
+// ENABLE_CONSOLE (settings.h) put_char() drops everything.
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Single character
+void put_char(char c);
+
+// Zero terminated string in RAM
+void put_str(const char *s);
+
+// Zero terminated string in flash, use with PSTR("...")
+void put_str_P(PGM_P s);
+
+// Two/four lower case hex digits, no prefix
+void put_hex8(uint8_t v);
+void put_hex16(uint16_t v);
+
+// Unsigned decimal, no leading zeros
+void put_dec(uint16_t v);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
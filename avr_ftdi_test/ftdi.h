@@ -0,0 +1,164 @@
+#ifndef FTDI_H
+#define FTDI_H
+
+// The FTDI personality of the USB device, shared by the modules that take over
+// the bulk endpoints (see `FtdiPersonality::mode`).
+
+#include "settings.h"
+#include <stdint.h>
+#include "usb_device.h"
+#include "crc.h"
+
+// What the bulk endpoints are used for
+enum {
+	ftdi_mode_uart = 0, // USB to serial bridge on the regular USART
+	ftdi_mode_loopback, // benchmark: EP2 -> RAM ring -> EP1, USART bypassed
+	ftdi_mode_prbs_gen, // benchmark: PRBS stream on EP1 at maximum rate
+	ftdi_mode_prbs_check, // benchmark: check the PRBS stream arriving on EP2
+	ftdi_mode_bitbang, // SET_BITMODE bit bang (asynchronous or synchronous) on PORTB
+	ftdi_mode_mpsse, // SET_BITMODE MPSSE command engine on the SPI
+	ftdi_mode_i2c, // I2C master driven by commands on EP2, wIndex = SCL [kHz]
+	ftdi_mode_adc, // ADC samples streamed on EP1, wIndex = sample rate [Hz]
+	ftdi_mode_la, // logic analyzer capture on EP1, wIndex = sample period [us] (0: burst)
+	ftdi_mode_gen, // samples from EP2 put out on a port or PWM, wIndex = sample rate [Hz]
+};
+
+// The FTDI flavour of our USB device: descriptors, vendor requests and the
+// handling of the serial data on the bulk endpoints
+struct FtdiPersonality
+{
+	static uint8_t get_desc(uint8_t type, uint8_t idx, const void **addr, uint8_t *len);
+	static uint8_t control_in(void);
+	static uint8_t control_out(void);
+	static void configured(void) {}
+	static void service(void);
+
+	// What the bulk endpoints are used for, one of ftdi_mode_*
+	static uint8_t mode;
+
+	// RAM shared by the streaming modes (ADC, logic analyzer, generator). Only
+	// one mode runs at a time, the previous one is stopped before the next starts.
+	static const uint16_t mode_ram_size = 256;
+	static volatile uint8_t mode_ram[mode_ram_size];
+
+	// Writes the two bytes every FTDI IN packet starts with to the selected
+	// endpoint, with `modem` (FTDI_MS_*) or'ed into the modem status
+	static void send_reserved_bytes(uint8_t modem = 0);
+
+	// True if an IN packet with `n` payload bytes should be sent now: when it is
+	// full, or when there is something and the latency timer expired
+	static bool in_packet_due(uint8_t n);
+
+	// Restarts the latency timer, call after sending an IN packet
+	static void in_packet_sent(void);
+
+private:
+	static void handle_outgoing_bytes(void);
+	static void handle_incoming_bytes(void);
+
+	// Latency timer as set by the host [ms]
+	static uint8_t latency;
+	// Tick of the last IN packet
+	static uint16_t last_in;
+
+	// Polled instead of interrupt driven USART transfers, per direction (see uart_rx_burst)
+	static uint8_t rx_polled, tx_polled;
+	// Tick of the last OUT packet
+	static uint16_t last_out;
+
+	// 9-bit mode: where the escape sequence of the OUT stream stands (see uart.h)
+	static uint8_t tx_esc;
+	static void send_escaped(uint8_t c);
+
+	// Framed mode: idle gap on the USART RX line that ends a frame [us], 0: off
+	static uint16_t frame_gap;
+	// Starts the gap detection if framed mode is on, for UART mode
+	static void framing_start(void);
+	// Receive ring positions where frames ended that weren't sent completely yet
+	static uint8_t frame_end[];
+	static uint8_t frames;
+	// The last frame ended with a full packet, a short one has to end the transfer
+	static uint8_t frame_short;
+	// Modem status bits (FTDI_MS_*) sent with the end of each frame in frame_end
+	static uint8_t frame_status[];
+	// Drops the oldest frame end
+	static void frame_pop(void);
+
+	// CRC offload (CRC_*): received frames are checked, the OUT stream gets a
+	// CRC appended at the end of every transfer (short packet)
+	static uint8_t crc_rx, crc_tx, crc_discard;
+	static crc_counters crc_count;
+	// RX check: CRC and length (saturating at 255) of the current frame up to
+	// ring position crc_pos, kept up to date as bytes arrive
+	static uint16_t rx_crc;
+	static uint8_t crc_pos, crc_len;
+	static void check_advance(uint8_t to);
+	// Ends the current frame at ring position `end`, returns FTDI_MS_FRAME_BAD
+	// if it fails the check
+	static uint8_t check_frame(uint8_t end);
+	// Part of the oldest frame went to the host already, so it can't be
+	// discarded any more
+	static uint8_t frame_sending;
+	// CRC of the transfer so far, bytes taken from the current OUT bank
+	static uint16_t tx_crc;
+	static uint8_t tx_taken, tx_frame;
+	static void send_crc(void);
+};
+
+// Bytes waiting in the receive ring at which sustained RX load is assumed
+static const uint8_t ftdi_rx_poll_enter = 32;
+// Idle time after which the EP2 -> USART direction goes back to interrupts [ms]
+static const uint8_t ftdi_tx_poll_exit = 2;
+// Frame ends kept while the host doesn't read, more frames are merged into the last one
+static const uint8_t ftdi_max_frames = 4;
+// With CRC checking a frame is held in the receive ring until it ends, unless
+// it grows to this many bytes: then it is passed on as it arrives (and only
+// flagged when it is bad), so a 256 byte Modbus RTU frame still gets through
+static const uint8_t ftdi_rx_hold_max = 192;
+
+// The FTDI has two endpoints for serial data, they are:
+//
+// Endpoint 1 (IN):
+//   bEndpointAddress:     0x81
+//   Transfer Type:        Bulk
+//   wMaxPacketSize:     0x0040 (64)
+//   bInterval:            0x00
+//
+// Endpoint 2 (OUT):
+//   bEndpointAddress:     0x02
+//   Transfer Type:        Bulk
+//   wMaxPacketSize:     0x0040 (64)
+//   bInterval:            0x00
+struct FtdiConfig
+{
+	// Endpoint 0 size
+	// NOTE: FTDI defines this as 8 bytes instead, but 64 is much easier to program as we don't have
+	// split up the bigger transfers.
+	static const uint8_t ep0_size = 64;
+	static const uint8_t ep_in = 1;
+	static const uint8_t ep_out = 2;
+	static const uint8_t bulk_size = 64;
+	// Double buffered, so one bank can be filled (emptied) while the host
+	// reads (writes) the other
+	static const uint8_t in_banks = 2;
+	static const uint8_t out_banks = 2;
+	// USB power management is not supported (yet)
+	static const bool handle_suspend = false;
+	// Trace characters share the USART with the bridged data, so only with a
+	// console (see settings.h), and then Release builds only report errors
+#if !defined(ENABLE_CONSOLE)
+	static const uint8_t trace_level = usb_trace_off;
+#elif defined(NDEBUG)
+	static const uint8_t trace_level = usb_trace_errors;
+#else
+	static const uint8_t trace_level = usb_trace_all;
+#endif
+	typedef FtdiPersonality Personality;
+};
+
+typedef UsbDevice<FtdiConfig> Usb;
+
+// Payload bytes in a full IN packet, after the two reserved bytes
+static const uint8_t ftdi_in_payload = FtdiConfig::bulk_size - 2;
+
+#endif // FTDI_H
@@ -0,0 +1,189 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "ftdi.h"
+#include "gen.h"
+
+// Sample FIFO, 8-bit indices wrap with GEN_SIZE-1 as mask
+#define GEN_SIZE 256
+static volatile uint8_t *const fifo = FtdiPersonality::mode_ram;
+static_assert(FtdiPersonality::mode_ram_size >= GEN_SIZE, "FIFO doesn't fit");
+static volatile uint8_t head, tail; // head written by the main loop, tail by the ISR
+
+// As configured, and as latched by gen_start() for the running mode
+static uint8_t cfg_output = GEN_OUT_PORT;
+static uint8_t cfg_mask = 0xff;
+static uint8_t output = GEN_OUT_PORT;
+static uint8_t out_mask = 0xff;
+
+static volatile uint8_t running; // set by the main loop, cleared by the ISR when the FIFO ran dry
+static volatile uint8_t draining; // the last OUT packet was a short one
+static volatile uint8_t lost; // underrun since the last status packet
+static volatile uint16_t underruns;
+static volatile uint32_t samples;
+static uint16_t actual_rate;
+
+// Status packet payload: underruns, FIFO level, running
+#define GEN_STATUS_SIZE 4
+
+// One sample per period. Compare A and B are the bit bang and logic analyzer
+// vectors, this one matches at BOTTOM (OCR3C = 0).
+ISR(TIMER3_COMPC_vect)
+{
+	if (!running)
+		return;
+
+	uint8_t t = tail;
+
+	if (t == head) {
+		// Hold the output until the FIFO is primed again
+		running = 0;
+		if (!draining) {
+			underruns++;
+			lost = 1;
+		}
+		return;
+	}
+
+	uint8_t v = fifo[t];
+	if (output == GEN_OUT_PWM)
+		OCR4D = v;
+	else
+		PORTB = v & out_mask;
+	tail = (t + 1) & (GEN_SIZE - 1);
+	samples++;
+}
+
+void gen_config(uint8_t out, uint8_t mask)
+{
+	cfg_output = out == GEN_OUT_PWM ? GEN_OUT_PWM : GEN_OUT_PORT;
+	cfg_mask = mask;
+}
+
+void gen_start(uint16_t rate)
+{
+	TIMSK3 = 0;
+
+	head = tail = 0;
+	running = 0;
+	draining = 0;
+	lost = 0;
+	underruns = 0;
+	samples = 0;
+	output = cfg_output;
+	out_mask = cfg_mask;
+
+	if (!rate)
+		rate = 1000;
+
+	if (output == GEN_OUT_PWM) {
+		// Timer4: fast PWM, TOP = OCR4C = 255, clk_io (Usb::init leaves
+		// PLLTM1:0 at 0) without prescaler, OC4D non-inverted
+		TCCR4B = 0;
+		TCCR4A = 0;
+		TCCR4D = 0;
+		TC4H = 0;
+		OCR4C = 255;
+		OCR4D = 0;
+		TCCR4C = (1<<COM4D1) | (1<<PWM4D);
+		TCCR4B = (1<<CS40);
+		DDRD |= (1<<DDD7);
+	} else {
+		PORTB &= out_mask;
+		DDRB = out_mask;
+	}
+
+	// Timer3: CTC mode, prescaler as small as the rate allows
+	static const uint8_t shift[] = { 0, 3, 6, 8 }; // clk/1, /8, /64, /256
+	uint32_t ticks = F_CPU / rate;
+	uint8_t i = 0;
+	while (i < 3 && (ticks >> shift[i]) > 65536)
+		i++;
+	ticks >>= shift[i];
+	actual_rate = (F_CPU >> shift[i]) / ticks;
+
+	TCCR3A = 0;
+	TCCR3B = (1<<WGM32) | (i + 1);
+	OCR3A = ticks - 1;
+	OCR3C = 0;
+	TCNT3 = 0;
+	TIFR3 = (1<<OCF3C);
+	TIMSK3 = (1<<OCIE3C);
+}
+
+void gen_stop(void)
+{
+	TIMSK3 = 0;
+	TCCR3B = 0;
+
+	if (output == GEN_OUT_PWM) {
+		TCCR4C = 0;
+		TCCR4B = 0;
+		DDRD &= ~(1<<DDD7);
+		PORTD &= ~(1<<PORTD7);
+	} else {
+		DDRB = 0;
+		PORTB = 0;
+	}
+}
+
+void gen_get(gen_counters *out)
+{
+	uint8_t sreg = SREG;
+	cli();
+	out->samples = samples;
+	out->underruns = underruns;
+	SREG = sreg;
+	out->rate = actual_rate;
+}
+
+void gen_service(void)
+{
+	// EP2 -> FIFO, only when the whole bank fits
+	EP_select(FtdiConfig::ep_out);
+
+	if (Reg_UEINTX::any<_BV(RXOUTI)>()) {
+		uint8_t n = UEBCLX;
+		uint8_t h = head;
+		uint8_t room = (tail - h - 1) & (GEN_SIZE - 1);
+
+		if (n <= room) {
+			draining = n < FtdiConfig::bulk_size;
+			while (n--) {
+				fifo[h] = UEDATX;
+				h = (h + 1) & (GEN_SIZE - 1);
+			}
+			head = h;
+			Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+		}
+	}
+
+	uint8_t level = (head - tail) & (GEN_SIZE - 1);
+
+	// Prime the FIFO before the output starts, so it can ride out USB jitter
+	if (!running && level && (level >= GEN_SIZE / 2 || draining))
+		running = 1;
+
+	// Status -> EP1
+	EP_select(FtdiConfig::ep_in);
+
+	if (Reg_UEINTX::any<_BV(TXINI)>() && FtdiPersonality::in_packet_due(GEN_STATUS_SIZE)) {
+		uint8_t sreg = SREG;
+		cli();
+		uint8_t l = lost;
+		uint16_t u = underruns;
+		lost = 0;
+		SREG = sreg;
+
+		UEDATX = 0x80; // Modem status.
+		UEDATX = l ? FTDI_LSR_OE : 0; // Line status.
+		UEDATX = u & 0xff;
+		UEDATX = u >> 8;
+		UEDATX = level;
+		UEDATX = running;
+
+		Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+		FtdiPersonality::in_packet_sent();
+	}
+}
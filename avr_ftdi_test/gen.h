@@ -0,0 +1,65 @@
+#ifndef GEN_H
+#define GEN_H
+
+// Waveform/pattern generator: EP2 data is a stream of samples, put out at a
+// fixed rate.
+//
+// Configured with FW_REQ_GEN_CONFIG (wValue = GEN_OUT_* | pin mask << 8) and
+// started with FW_REQ_SET_MODE (wValue = ftdi_mode_gen, wIndex = sample rate
+// [Hz]). Every byte arriving on EP2 is one sample:
+//
+//  GEN_OUT_PORT: written to PORTB, the pins in the mask are outputs
+//  GEN_OUT_PWM:  the duty cycle (0..255) of the 62.5 kHz 8-bit PWM on OC4D
+//                (PD7, Leonardo D6), a DAC with an RC low pass behind it
+//
+// The Timer3 compare C ISR takes one sample from a RAM FIFO per period, so USB
+// jitter doesn't reach the output. Together with the two OUT banks it holds
+// up to 383 samples. Output starts once the FIFO is half full, or when a
+// short packet (the end of a write) arrived. When the FIFO runs dry the
+// output holds its last value until it is primed again; unless the last
+// packet was a short one that counts as an underrun.
+//
+// EP1 carries a status packet every latency timer period:
+//
+//   0x80, line status     the usual FTDI status bytes, FTDI_LSR_OE set after
+//                         an underrun since the previous status packet
+//   underruns (2, LE)     since the mode was started
+//   FIFO level            samples waiting in the RAM FIFO
+//   running               1 while samples are put out
+//
+// The counters can also be read with FW_REQ_GET_GEN.
+//
+// NOTE: the mode uses Timer3 (like the bit bang and logic analyzer modes) and
+// Timer4.
+
+#include <stdint.h>
+
+// Outputs (wValue of FW_REQ_GEN_CONFIG)
+#define GEN_OUT_PORT 0
+#define GEN_OUT_PWM 1
+
+// Counters, as sent to the host (little endian)
+typedef struct
+{
+	uint32_t samples; // samples put out since the mode was started
+	uint16_t underruns;
+	uint16_t rate; // [Hz] actually used
+} __attribute__((packed)) gen_counters;
+
+// Selects the output for the next gen_start(), a running generator keeps its
+// output until it is started again
+void gen_config(uint8_t out, uint8_t mask);
+
+// Starts putting out samples at `rate` Hz (0: 1000 Hz)
+void gen_start(uint16_t rate);
+
+// Stops the timers and makes the pins inputs again
+void gen_stop(void);
+
+// Copies the counters
+void gen_get(gen_counters *out);
+
+// Main loop work: EP2 -> FIFO, status packets on EP1
+void gen_service(void);
+
+#endif // GEN_H
@@ -0,0 +1,340 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "ftdi.h"
+#include "i2c.h"
+
+// Rings, 8-bit indices wrap with I2C_RING_SIZE-1 as mask
+#define I2C_RING_SIZE 128
+static volatile uint8_t cmd_buf[I2C_RING_SIZE]; // from EP2, read by the ISR
+static volatile uint8_t cmd_head, cmd_tail;
+static volatile uint8_t res_buf[I2C_RING_SIZE]; // to EP1, written by the ISR
+static volatile uint8_t res_head, res_tail;
+
+// What the engine does next
+enum {
+	ph_fetch, // decode the next command
+	ph_address, // START: waiting for the address byte
+	ph_start_sent,
+	ph_address_sent,
+	ph_write_len,
+	ph_write, // waiting for the next data byte
+	ph_write_sent,
+	ph_read_len,
+	ph_read,
+	ph_read_sent,
+};
+static uint8_t phase;
+static uint8_t address;
+static uint8_t left; // data bytes left of the current WRITE/READ
+static uint8_t status; // of the current command
+
+// Set while a bus action is in progress, the TWI interrupt continues from there
+static volatile uint8_t busy;
+static volatile uint8_t flush; // set by I2C_CMD_FLUSH
+
+#define TWI_GO ((1<<TWINT) | (1<<TWEN) | (1<<TWIE))
+
+static inline uint8_t cmd_available(void)
+{
+	return (cmd_head - cmd_tail) & (I2C_RING_SIZE - 1);
+}
+
+static inline uint8_t cmd_get(void)
+{
+	uint8_t t = cmd_tail;
+	uint8_t c = cmd_buf[t];
+	cmd_tail = (t + 1) & (I2C_RING_SIZE - 1);
+	return c;
+}
+
+static inline uint8_t res_room(void)
+{
+	return (res_tail - res_head - 1) & (I2C_RING_SIZE - 1);
+}
+
+static inline void res_put(uint8_t c)
+{
+	uint8_t h = res_head;
+	res_buf[h] = c;
+	res_head = (h + 1) & (I2C_RING_SIZE - 1);
+}
+
+// Bus state after the last action, as in the TWI status register (TWSR)
+static inline uint8_t twi_status(void)
+{
+	return TWSR & 0xf8;
+}
+
+// Runs the commands as far as possible: until a bus action was started (the
+// interrupt continues when it is done), or the commands or result room ran out.
+// Called from the TWI interrupt, and with interrupts disabled from i2c_service().
+static void step(void)
+{
+	for (;;) {
+		switch (phase) {
+		case ph_fetch:
+			// Every command produces at most 2 result bytes at a time
+			if (!cmd_available() || res_room() < 2)
+				goto wait;
+			switch (cmd_get()) {
+			case I2C_CMD_START:
+				phase = ph_address;
+				break;
+			case I2C_CMD_WRITE:
+				phase = ph_write_len;
+				break;
+			case I2C_CMD_READ:
+				phase = ph_read_len;
+				break;
+			case I2C_CMD_STOP:
+				// No interrupt follows a STOP, it's done within about one SCL period
+				TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
+				while (TWCR & (1<<TWSTO))
+					;
+				break;
+			case I2C_CMD_FLUSH:
+				flush = 1;
+				break;
+			default:
+				res_put(I2C_BAD_COMMAND);
+				break;
+			}
+			break;
+
+		case ph_address:
+			if (!cmd_available())
+				goto wait;
+			address = cmd_get();
+			phase = ph_start_sent;
+			TWCR = TWI_GO | (1<<TWSTA);
+			goto in_progress;
+
+		case ph_start_sent:
+			if (twi_status() != 0x08 && twi_status() != 0x10) {
+				res_put(I2C_ERROR);
+				phase = ph_fetch;
+				break;
+			}
+			phase = ph_address_sent;
+			TWDR = address;
+			TWCR = TWI_GO;
+			goto in_progress;
+
+		case ph_address_sent:
+			switch (twi_status()) {
+			case 0x18: // SLA+W ACKed
+			case 0x40: // SLA+R ACKed
+				res_put(I2C_OK);
+				break;
+			case 0x20: // SLA+W NACKed
+			case 0x48: // SLA+R NACKed
+				res_put(I2C_NACK);
+				break;
+			default:
+				res_put(I2C_ERROR);
+				break;
+			}
+			phase = ph_fetch;
+			break;
+
+		case ph_write_len:
+			if (!cmd_available())
+				goto wait;
+			left = cmd_get();
+			status = I2C_OK;
+			phase = ph_write;
+			if (!left) {
+				res_put(status);
+				phase = ph_fetch;
+			}
+			break;
+
+		case ph_write:
+			if (!cmd_available())
+				goto wait;
+			if (status == I2C_OK) {
+				TWDR = cmd_get();
+				phase = ph_write_sent;
+				TWCR = TWI_GO;
+				goto in_progress;
+			}
+			cmd_get();
+			// Skip the rest after a failure
+			if (!--left) {
+				res_put(status);
+				phase = ph_fetch;
+			}
+			break;
+
+		case ph_write_sent:
+			if (twi_status() == 0x30)
+				status = I2C_NACK;
+			else if (twi_status() != 0x28)
+				status = I2C_ERROR;
+			phase = ph_write;
+			if (!--left) {
+				res_put(status);
+				phase = ph_fetch;
+			}
+			break;
+
+		case ph_read_len:
+			if (!cmd_available())
+				goto wait;
+			left = cmd_get();
+			status = I2C_OK;
+			phase = ph_read;
+			if (!left) {
+				res_put(status);
+				phase = ph_fetch;
+			}
+			break;
+
+		case ph_read:
+			if (res_room() < 2)
+				goto wait;
+			if (status != I2C_OK) {
+				res_put(0xff);
+			} else {
+				// ACK all but the last byte
+				phase = ph_read_sent;
+				TWCR = TWI_GO | (left > 1 ? (1<<TWEA) : 0);
+				goto in_progress;
+			}
+			if (!--left) {
+				res_put(status);
+				phase = ph_fetch;
+			}
+			break;
+
+		case ph_read_sent:
+			if (twi_status() == 0x50 || twi_status() == 0x58) {
+				res_put(TWDR);
+			} else {
+				res_put(0xff);
+				status = I2C_ERROR;
+			}
+			phase = ph_read;
+			if (!--left) {
+				res_put(status);
+				phase = ph_fetch;
+			}
+			break;
+		}
+	}
+
+wait:
+	// Nothing to do until the main loop brings more commands or takes results.
+	// TWINT is left alone, so a pending bus state is held (SCL low).
+	busy = 0;
+	TWCR = (1<<TWEN);
+	return;
+
+in_progress:
+	busy = 1;
+}
+
+ISR(TWI_vect)
+{
+	step();
+}
+
+void i2c_start(uint16_t khz)
+{
+	TWCR = 0;
+	cmd_head = cmd_tail = 0;
+	res_head = res_tail = 0;
+	phase = ph_fetch;
+	busy = 0;
+	flush = 0;
+
+	// SCL = F_CPU / (16 + 2 * TWBR * 4^TWPS), 400 kHz at most
+	if (!khz)
+		khz = 100;
+	if (khz > 400)
+		khz = 400;
+	uint32_t div = (F_CPU / 1000 / khz - 16) / 2;
+	uint8_t ps = 0;
+	while (div > 255 && ps < 3) {
+		div /= 4;
+		ps++;
+	}
+	TWBR = div > 255 ? 255 : div;
+	TWSR = ps << TWPS0;
+
+	// Weak internal pull ups, for short wires without external ones
+	PORTD |= (1<<PORTD0) | (1<<PORTD1);
+	TWCR = (1<<TWEN);
+}
+
+void i2c_stop(void)
+{
+	if (TWCR & (1<<TWINT)) {
+		// Still owning the bus
+		TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
+		while (TWCR & (1<<TWSTO))
+			;
+	}
+	TWCR = 0;
+	PORTD &= ~((1<<PORTD0) | (1<<PORTD1));
+}
+
+void i2c_service(void)
+{
+	// EP2 -> command ring, only when the whole bank fits
+	EP_select(FtdiConfig::ep_out);
+
+	if (Reg_UEINTX::any<_BV(RXOUTI)>()) {
+		uint8_t n = UEBCLX;
+		uint8_t h = cmd_head;
+
+		if (n <= (uint8_t)((cmd_tail - h - 1) & (I2C_RING_SIZE - 1))) {
+			while (n--) {
+				cmd_buf[h] = UEDATX;
+				h = (h + 1) & (I2C_RING_SIZE - 1);
+			}
+			cmd_head = h;
+			Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+		}
+	}
+
+	// Get the engine going again if it ran out of commands or room
+	if (!busy) {
+		uint8_t sreg = SREG;
+		cli();
+		if (!busy)
+			step();
+		SREG = sreg;
+	}
+
+	// Results -> EP1
+	EP_select(FtdiConfig::ep_in);
+
+	if (Reg_UEINTX::any<_BV(TXINI)>()) {
+		uint8_t t = res_tail;
+
+		// The ISR may add results and set `flush` meanwhile
+		uint8_t sreg = SREG;
+		cli();
+		uint8_t n = (res_head - t) & (I2C_RING_SIZE - 1);
+		if (!n)
+			flush = 0;
+		uint8_t f = flush;
+		SREG = sreg;
+
+		if (FtdiPersonality::in_packet_due(n) || f) {
+			if (n > ftdi_in_payload)
+				n = ftdi_in_payload;
+
+			FtdiPersonality::send_reserved_bytes();
+			while (n--) {
+				UEDATX = res_buf[t];
+				t = (t + 1) & (I2C_RING_SIZE - 1);
+			}
+			res_tail = t;
+			Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+			FtdiPersonality::in_packet_sent();
+		}
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef I2C_H
+#define I2C_H
+
+// I2C master on the TWI peripheral (Arduino Leonardo SCL = PD0, SDA = PD1),
+// driven by a stream of commands on EP2.
+//
+// Selected with the FW_REQ_SET_MODE vendor request, wValue = ftdi_mode_i2c,
+// wIndex = SCL clock [kHz] (0: 100 kHz). The commands are executed by the TWI
+// interrupt as they arrive, so any number of transactions can be sent in one
+// packet (or split over several, commands may span packets). Results are sent
+// on EP1 behind the usual two FTDI status bytes, when a packet is full, the
+// latency timer expired or after an I2C_CMD_FLUSH.
+//
+//   command                   result
+//   I2C_CMD_START addr        status                (repeated start when not stopped)
+//   I2C_CMD_WRITE n d1..dn    status                (n = 0..255)
+//   I2C_CMD_READ n            d1..dn status         (all but the last byte ACKed)
+//   I2C_CMD_STOP              -
+//   I2C_CMD_FLUSH             -
+//
+// `addr` is the 7 bit address shifted left, with the R/W bit as bit 0.
+// After a NACK or error the bus stays owned until the host sends I2C_CMD_STOP;
+// the rest of a WRITE is skipped (its data bytes are still expected) and the
+// rest of a READ gives 0xff.
+
+#include <stdint.h>
+
+// Commands
+#define I2C_CMD_START 0x01
+#define I2C_CMD_WRITE 0x02
+#define I2C_CMD_READ 0x03
+#define I2C_CMD_STOP 0x04
+#define I2C_CMD_FLUSH 0x05
+
+// Status bytes
+#define I2C_OK 0x00
+#define I2C_NACK 0x01 // address or data byte not acknowledged
+#define I2C_ERROR 0x02 // arbitration lost or bus error
+#define I2C_BAD_COMMAND 0x03 // unknown command byte, it is skipped
+
+// Starts the engine with an SCL clock of `khz` kHz
+void i2c_start(uint16_t khz);
+
+// Releases the bus and turns the TWI off
+void i2c_stop(void);
+
+// Main loop work: EP2 -> command ring, results -> EP1
+void i2c_service(void);
+
+#endif // I2C_H
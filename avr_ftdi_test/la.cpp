@@ -0,0 +1,369 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "regs.h"
+#include "usb.h"
+#include "ftdi.h"
+#include "la.h"
+
+// Capture ring, the 8-bit indices wrap by themselves.
+// Before the trigger head and tail belong to the ISR, after it tail belongs to the main loop.
+#define LA_SIZE 256
+static volatile uint8_t *const ring = FtdiPersonality::mode_ram;
+static_assert(FtdiPersonality::mode_ram_size >= LA_SIZE, "capture ring doesn't fit");
+static volatile uint8_t head, tail;
+
+static volatile uint8_t *const pins[] = { &PINB, &PINC, &PIND, &PINF };
+static uint8_t port = LA_PORT_B;
+static volatile uint8_t *pin = &PINB;
+static uint8_t chan_mask = 0xff;
+static uint8_t pre_cfg;
+
+static uint8_t trig_type, trig_mask, trig_value;
+
+static volatile uint8_t state;
+static volatile uint8_t armed; // pattern trigger may fire (edge trigger: mismatch seen)
+static volatile uint8_t pre;
+static volatile uint8_t lost; // runs dropped since the last packet
+static volatile uint32_t samples;
+static volatile uint16_t dropped;
+
+// Timed capture, ISR only
+static uint8_t last, run, pre_max;
+
+// Burst capture
+static uint8_t burst;
+static uint16_t left; // bytes still to send
+
+// Timed capture: one sample per period, run length encoded.
+// Compare A is the bit bang modes' vector, this one matches at BOTTOM (OCR3B = 0).
+ISR(TIMER3_COMPB_vect)
+{
+	uint8_t v = *pin & chan_mask;
+	uint8_t r = run;
+
+	samples++;
+
+	if (v == last && r != 255) {
+		run = r + 1;
+		return;
+	}
+
+	// Store the finished run
+	uint8_t h = head;
+	uint8_t s = state;
+
+	if (s != LA_TRIGGERED || (uint8_t)(tail - h - 1) >= 2) {
+		ring[h] = last;
+		ring[(uint8_t)(h + 1)] = r;
+		head = h + 2;
+		// Only the pre-trigger history is kept until the trigger
+		if (s != LA_TRIGGERED && (uint8_t)(head - tail) > pre_max)
+			tail += 2;
+	} else {
+		dropped++;
+		lost = 1;
+	}
+
+	last = v;
+	run = 1;
+
+	if (s != LA_TRIGGERED) {
+		if ((v & trig_mask) != trig_value) {
+			armed = 1;
+		} else if (armed) {
+			pre = head - tail;
+			state = LA_TRIGGERED;
+		}
+	}
+}
+
+// Burst capture into the ring from `pos` on, one sample every LA_BURST_CYCLES:
+//
+//   1: `warm` samples, the pre-trigger history (at least 1)
+//   3: until (port & m2) != v2, ends at once for anything but an edge trigger
+//   6: until (port & mask) == value, the trigger sample
+//  10: `post` samples (at least 1)
+//
+// Returns 0 when it gave up because the tick (OCF0A) came first. Interrupts
+// must be off. Every loop, and every step from one loop into the next, takes
+// 12 cycles per sample. X wraps at the end of the ring by taking 256 off XH,
+// the ring doesn't need to be aligned.
+template<typename Pin>
+static uint8_t burst_capture(volatile uint8_t *&pos, uint8_t warm, uint8_t post,
+	uint8_t m2, uint8_t v2, uint8_t mask, uint8_t value)
+{
+	uint8_t done, s;
+
+	asm volatile(
+		"1:\n\t"
+		"in %[s], %[pin]\n\t"		// 1
+		"st X+, %[s]\n\t"		// 2
+		"cp r26, %[end]\n\t"		// 1
+		"brne 2f\n\t"			// 2 | 1
+		"dec r27\n"			//   | 1
+		"2:\n\t"
+		"rjmp .+0\n\t"			// 2
+		"nop\n\t"			// 1
+		"dec %[warm]\n\t"		// 1
+		"brne 1b\n\t"			// 2, on exit 1 ...
+		"nop\n"				// ... + 1
+
+		"3:\n\t"
+		"in %[s], %[pin]\n\t"		// 1
+		"st X+, %[s]\n\t"		// 2
+		"cp r26, %[end]\n\t"		// 1
+		"brne 4f\n\t"			// 2 | 1
+		"dec r27\n"			//   | 1
+		"4:\n\t"
+		"and %[s], %[m2]\n\t"		// 1
+		"cp %[s], %[v2]\n\t"		// 1
+		"brne 5f\n\t"			// 1, on exit 2 ...
+		"sbis %[tifr], %[ocf]\n\t"	// 1
+		"rjmp 3b\n\t"			// 2
+		"rjmp 9f\n"
+		"5:\n\t"
+		"rjmp .+0\n"			// ... + 2
+
+		"6:\n\t"
+		"in %[s], %[pin]\n\t"		// 1
+		"st X+, %[s]\n\t"		// 2
+		"cp r26, %[end]\n\t"		// 1
+		"brne 7f\n\t"			// 2 | 1
+		"dec r27\n"			//   | 1
+		"7:\n\t"
+		"and %[s], %[mask]\n\t"		// 1
+		"cp %[s], %[value]\n\t"		// 1
+		"breq 8f\n\t"			// 1, on exit 2 ...
+		"sbis %[tifr], %[ocf]\n\t"	// 1
+		"rjmp 6b\n\t"			// 2
+		"rjmp 9f\n"
+		"8:\n\t"
+		"rjmp .+0\n"			// ... + 2
+
+		"10:\n\t"
+		"in %[s], %[pin]\n\t"		// 1
+		"st X+, %[s]\n\t"		// 2
+		"cp r26, %[end]\n\t"		// 1
+		"brne 11f\n\t"			// 2 | 1
+		"dec r27\n"			//   | 1
+		"11:\n\t"
+		"rjmp .+0\n\t"			// 2
+		"nop\n\t"			// 1
+		"dec %[post]\n\t"		// 1
+		"brne 10b\n\t"			// 2
+		"ldi %[done], 1\n\t"
+		"rjmp 12f\n"
+
+		"9:\n\t"
+		"ldi %[done], 0\n"
+		"12:\n\t"
+		: [done] "=&d" (done),
+		  [s] "=&r" (s),
+		  [warm] "+r" (warm),
+		  [post] "+r" (post),
+		  "+x" (pos)
+		: [pin] "I" (Pin::addr - __SFR_OFFSET),
+		  [tifr] "I" (_SFR_IO_ADDR(TIFR0)),
+		  [ocf] "I" (OCF0A),
+		  [end] "r" ((uint8_t)(uintptr_t)(ring + LA_SIZE)),
+		  [m2] "r" (m2),
+		  [v2] "r" (v2),
+		  [mask] "r" (mask),
+		  [value] "r" (value)
+		: "memory"
+	);
+
+	return done;
+}
+
+// Arms the burst capture once, returns when it triggered or at the next tick
+static void burst_arm(void)
+{
+	// An edge trigger first waits for a mismatch, anything else goes right on
+	uint8_t m2 = 0, v2 = 1;
+	uint8_t mask = trig_mask, value = trig_value;
+
+	if (trig_type == LA_TRIG_EDGE) {
+		m2 = mask;
+		v2 = value;
+	} else if (trig_type == LA_TRIG_NONE) {
+		mask = value = 0;
+	}
+
+	uint8_t p = pre_cfg > 254 ? 254 : pre_cfg;
+	uint8_t warm = p ? p : 1;
+	uint8_t post = 255 - p;
+	volatile uint8_t *pos = ring;
+	uint8_t done = 0;
+
+	uint8_t sreg = SREG;
+	cli();
+	switch (port) {
+	case LA_PORT_B:
+		done = burst_capture<Reg_PINB>(pos, warm, post, m2, v2, mask, value);
+		break;
+	case LA_PORT_C:
+		done = burst_capture<Reg_PINC>(pos, warm, post, m2, v2, mask, value);
+		break;
+	case LA_PORT_D:
+		done = burst_capture<Reg_PIND>(pos, warm, post, m2, v2, mask, value);
+		break;
+	case LA_PORT_F:
+		done = burst_capture<Reg_PINF>(pos, warm, post, m2, v2, mask, value);
+		break;
+	}
+	SREG = sreg;
+
+	if (!done)
+		return;
+
+	// The oldest sample is where the next one would have gone
+	tail = pos - ring;
+	left = LA_SIZE;
+	pre = p;
+	samples = LA_SIZE;
+	state = LA_TRIGGERED;
+}
+
+void la_config(uint8_t p, uint8_t mask, uint16_t depth)
+{
+	if (p > LA_PORT_F)
+		p = LA_PORT_B;
+	port = p;
+	pin = pins[p];
+	chan_mask = mask;
+	pre_cfg = depth > 255 ? 255 : depth;
+}
+
+void la_trigger(uint8_t type, uint8_t mask, uint8_t value)
+{
+	trig_type = type > LA_TRIG_EDGE ? LA_TRIG_NONE : type;
+	trig_mask = mask;
+	trig_value = value & mask;
+}
+
+void la_start(uint16_t period)
+{
+	TIMSK3 = 0;
+
+	head = tail = 0;
+	samples = 0;
+	dropped = 0;
+	lost = 0;
+	pre = 0;
+	left = 0;
+	state = LA_ARMED;
+	burst = period == 0;
+
+	if (burst)
+		return;
+
+	// The sample taken now starts the first run. The ring holds whole runs, so
+	// the pre-trigger history is even and leaves room for the next run.
+	uint8_t v = *pin & chan_mask;
+
+	last = v;
+	run = 1;
+	samples = 1;
+	pre_max = (pre_cfg > 252 ? 252 : pre_cfg) & ~1;
+	armed = trig_type != LA_TRIG_EDGE;
+
+	if ((v & trig_mask) != trig_value)
+		armed = 1;
+	else if (trig_type == LA_TRIG_PATTERN)
+		state = LA_TRIGGERED;
+	if (trig_type == LA_TRIG_NONE)
+		state = LA_TRIGGERED;
+
+	if (period < LA_MIN_PERIOD_US)
+		period = LA_MIN_PERIOD_US;
+
+	// Timer3: CTC mode, prescaler as small as the period allows
+	uint32_t ticks = (uint32_t)period * (F_CPU / 1000000);
+	uint8_t cs = (1<<CS30);
+	if (ticks > 65536) {
+		ticks >>= 3;
+		cs = (1<<CS31); // clk/8
+		if (ticks > 65536) {
+			ticks >>= 3;
+			cs = (1<<CS31) | (1<<CS30); // clk/64
+		}
+	}
+
+	TCCR3A = 0;
+	TCCR3B = (1<<WGM32) | cs;
+	OCR3A = ticks - 1;
+	OCR3B = 0;
+	TCNT3 = 0;
+	TIFR3 = (1<<OCF3B);
+	TIMSK3 = (1<<OCIE3B);
+}
+
+void la_stop(void)
+{
+	TIMSK3 = 0;
+	TCCR3B = 0;
+}
+
+void la_get(la_counters *out)
+{
+	uint8_t sreg = SREG;
+	cli();
+	out->samples = samples;
+	out->dropped = dropped;
+	out->state = state;
+	out->pre = pre;
+	SREG = sreg;
+}
+
+void la_service(void)
+{
+	// Whatever the host sends is ignored
+	EP_select(FtdiConfig::ep_out);
+	if (Reg_UEINTX::any<_BV(RXOUTI)>())
+		Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+
+	if (state == LA_ARMED) {
+		if (burst)
+			burst_arm();
+		return;
+	}
+	if (state != LA_TRIGGERED)
+		return;
+
+	EP_select(FtdiConfig::ep_in);
+
+	if (!Reg_UEINTX::any<_BV(TXINI)>())
+		return;
+
+	uint8_t t = tail;
+	uint16_t n = burst ? left : (uint8_t)(head - t);
+
+	if (n > ftdi_in_payload)
+		n = ftdi_in_payload;
+	if (!FtdiPersonality::in_packet_due(n))
+		return;
+
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t l = lost;
+	lost = 0;
+	SREG = sreg;
+
+	UEDATX = 0x80; // Modem status.
+	UEDATX = l ? FTDI_LSR_OE : 0; // Line status.
+
+	for (uint8_t i = n; i; i--)
+		UEDATX = ring[t++];
+	tail = t;
+
+	Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+	FtdiPersonality::in_packet_sent();
+
+	if (burst) {
+		left -= n;
+		if (!left)
+			state = LA_DONE;
+	}
+}
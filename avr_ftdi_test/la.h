@@ -0,0 +1,87 @@
+#ifndef LA_H
+#define LA_H
+
+// Logic analyzer: captures one of the ports and streams the samples on EP1.
+//
+// Configured with FW_REQ_LA_CONFIG (wValue = LA_PORT_* | channel mask << 8,
+// wIndex = pre-trigger bytes) and FW_REQ_LA_TRIGGER (wValue = trigger mask |
+// trigger value << 8, wIndex = LA_TRIG_*), started with FW_REQ_SET_MODE
+// (wValue = ftdi_mode_la, wIndex = sample period [us], 0: burst capture).
+//
+// Timed capture: the Timer3 compare B ISR samples the port once per period and
+// run length encodes the (masked) samples into a 256 byte ring, as pairs
+//
+//   value, count          `count` (1..255) samples of the port value `value`
+//
+// A run is stored when the value changes or after 255 samples, so an idle bus
+// costs 2 bytes per 255 samples (and shows up with that delay). Before the
+// trigger the ring holds the pre-trigger history, the oldest runs are dropped.
+// From the trigger on the ring streams in regular FTDI packets until the mode
+// is stopped. Runs that don't fit are dropped and counted, and the next packet
+// has FTDI_LSR_OE set.
+//
+// Burst capture: a cycle counted loop with interrupts off samples the port
+// every LA_BURST_CYCLES into the ring, raw (all 8 pins), until the trigger,
+// and then until the ring holds the pre-trigger samples plus the rest. The 256
+// samples go to the host once, oldest first. To keep USB alive the loop gives up at every
+// tick (1 ms) and the main loop arms it again, which refills the pre-trigger
+// history first, so a trigger in that time (at most 190 us) is missed.
+//
+// Either way the trigger sample starts at byte `pre` of the capture stream
+// (see la_counters, read with FW_REQ_GET_LA).
+//
+// NOTE: the mode uses Timer3, like the bit bang modes.
+
+#include <stdint.h>
+
+// Ports (wValue of FW_REQ_LA_CONFIG)
+#define LA_PORT_B 0
+#define LA_PORT_C 1
+#define LA_PORT_D 2
+#define LA_PORT_F 3
+
+// Triggers (wIndex of FW_REQ_LA_TRIGGER)
+#define LA_TRIG_NONE 0 // capture right away
+#define LA_TRIG_PATTERN 1 // (port & mask) == value
+#define LA_TRIG_EDGE 2 // (port & mask) becomes value: the pattern after a mismatch
+
+// States
+#define LA_ARMED 0 // waiting for the trigger
+#define LA_TRIGGERED 1 // streaming
+#define LA_DONE 2 // burst capture sent
+
+// Shortest sample period of the timed capture [us], what the ISR can sustain
+#define LA_MIN_PERIOD_US 10
+
+// Sample period of the burst capture [cycles], 1.33 MHz at 16 MHz
+#define LA_BURST_CYCLES 12
+
+// Counters, as sent to the host (little endian)
+typedef struct
+{
+	uint32_t samples; // samples taken
+	uint16_t dropped; // runs dropped because the ring was full
+	uint8_t state; // LA_ARMED, LA_TRIGGERED or LA_DONE
+	uint8_t pre; // bytes before the trigger sample in the capture stream
+} __attribute__((packed)) la_counters;
+
+// Selects the port, the channels (other bits read as 0) and the pre-trigger
+// depth for the next la_start()
+void la_config(uint8_t port, uint8_t mask, uint16_t pre);
+
+// Sets the trigger for the next la_start()
+void la_trigger(uint8_t type, uint8_t mask, uint8_t value);
+
+// Arms the capture, `period` [us] for timed capture or 0 for burst capture
+void la_start(uint16_t period);
+
+// Stops the timer
+void la_stop(void);
+
+// Copies the counters
+void la_get(la_counters *out);
+
+// Main loop work: burst capture, ring -> EP1
+void la_service(void);
+
+#endif // LA_H
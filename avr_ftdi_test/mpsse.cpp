@@ -0,0 +1,297 @@
+#include "settings.h"
+#include <avr/io.h>
+#include "usb.h"
+#include "ftdi.h"
+#include "mpsse.h"
+
+// Data shifting opcode bits
+#define MPSSE_WRITE_NEG 0x01 // data out on the falling edge
+#define MPSSE_BITMODE 0x02 // lengths in bits (not supported)
+#define MPSSE_READ_NEG 0x04 // data in on the falling edge
+#define MPSSE_LSB 0x08 // LSB first
+#define MPSSE_DO_WRITE 0x10
+#define MPSSE_DO_READ 0x20
+#define MPSSE_WRITE_TMS 0x40 // (not supported)
+
+// Other opcodes
+#define MPSSE_SET_BITS_LOW 0x80
+#define MPSSE_GET_BITS_LOW 0x81
+#define MPSSE_LOOPBACK_START 0x84
+#define MPSSE_LOOPBACK_END 0x85
+#define MPSSE_TCK_DIVISOR 0x86
+#define MPSSE_SEND_IMMEDIATE 0x87
+#define MPSSE_DIV5_DISABLE 0x8a
+#define MPSSE_DIV5_ENABLE 0x8b
+#define MPSSE_3PHASE_DISABLE 0x8d
+#define MPSSE_ADAPTIVE_DISABLE 0x97
+#define MPSSE_BAD_COMMAND 0xfa
+
+// Parser state
+enum { st_opcode, st_args, st_data };
+static uint8_t state;
+static uint8_t op;
+static uint8_t args[2], argc;
+static uint32_t remaining; // data bytes left of the current command
+
+// SPCR bits of the clock rate, SPI2X of SPSR
+static uint8_t spcr_clock, spsr_clock;
+// Idle level of TCK (CPOL)
+static uint8_t tck_high;
+static uint8_t div5;
+
+// Read data for EP1, 8-bit indices wrap with IN_SIZE-1 as mask
+#define IN_SIZE 128
+static uint8_t in_buf[IN_SIZE];
+static uint8_t in_head, in_tail;
+static uint8_t flush; // send immediate pending
+
+static inline uint8_t in_room(void)
+{
+	return (in_tail - in_head - 1) & (IN_SIZE - 1);
+}
+
+static inline void push(uint8_t c)
+{
+	in_buf[in_head] = c;
+	in_head = (in_head + 1) & (IN_SIZE - 1);
+}
+
+static inline uint8_t spi_xfer(uint8_t c)
+{
+	SPDR = c;
+	while (!(SPSR & (1<<SPIF)))
+		;
+	return SPDR;
+}
+
+// ADBUS0..3 -> PB1, PB2, PB3, PB0, ADBUS4..7 -> PB4..7
+static inline uint8_t to_portb(uint8_t v)
+{
+	return (v & 0xf0) | ((v << 1) & 0x0e) | ((v >> 3) & 0x01);
+}
+
+static inline uint8_t from_portb(uint8_t v)
+{
+	return (v & 0xf0) | ((v >> 1) & 0x07) | ((v & 0x01) << 3);
+}
+
+static void set_bits_low(uint8_t value, uint8_t dir)
+{
+	tck_high = value & 0x01;
+	PORTB = to_portb(value);
+	DDRB = to_portb(dir) | (1<<DDB0);
+}
+
+// Fastest SPI clock not above the MPSSE clock for `divisor`
+static void set_clock(uint16_t divisor)
+{
+	uint32_t tck = (div5 ? 6000000UL : 30000000UL) / (divisor + 1UL);
+	uint8_t shift = 1;
+
+	while (shift < 7 && ((uint32_t)F_CPU >> shift) > tck)
+		shift++;
+
+	// F_CPU/2: SPI2X, /4: -, /8: SPI2X|SPR0, /16: SPR0, ... /128: SPR1|SPR0
+	spcr_clock = (shift - 1) / 2;
+	spsr_clock = (shift & 1) && shift < 7 ? (1<<SPI2X) : 0;
+	SPSR = spsr_clock;
+}
+
+// SPI mode for the data command `op`
+static void setup_spi(void)
+{
+	uint8_t cpha;
+
+	// Data that changes on the trailing edge and is sampled on the leading one is CPHA=1
+	if (op & MPSSE_DO_WRITE)
+		cpha = tck_high ^ !(op & MPSSE_WRITE_NEG);
+	else
+		cpha = tck_high ^ !!(op & MPSSE_READ_NEG);
+
+	SPCR = (1<<SPE) | (1<<MSTR) | spcr_clock
+		| ((op & MPSSE_LSB) ? (1<<DORD) : 0)
+		| (tck_high ? (1<<CPOL) : 0)
+		| (cpha ? (1<<CPHA) : 0);
+}
+
+static void bad_command(uint8_t c)
+{
+	push(MPSSE_BAD_COMMAND);
+	push(c);
+}
+
+// First byte of a command
+static void opcode(uint8_t c)
+{
+	op = c;
+	argc = 0;
+
+	if (!(c & 0x80)) {
+		// Data shifting, a 16 bit length follows
+		if ((c & (MPSSE_BITMODE | MPSSE_WRITE_TMS)) || !(c & (MPSSE_DO_WRITE | MPSSE_DO_READ)))
+			bad_command(c);
+		else
+			state = st_args;
+		return;
+	}
+
+	switch (c) {
+	case MPSSE_SET_BITS_LOW:
+	case MPSSE_TCK_DIVISOR:
+		state = st_args;
+		break;
+	case MPSSE_GET_BITS_LOW:
+		push(from_portb(PINB));
+		break;
+	case MPSSE_SEND_IMMEDIATE:
+		flush = 1;
+		break;
+	case MPSSE_DIV5_DISABLE:
+	case MPSSE_DIV5_ENABLE:
+		div5 = c == MPSSE_DIV5_ENABLE;
+		break;
+	case MPSSE_LOOPBACK_END:
+	case MPSSE_3PHASE_DISABLE:
+	case MPSSE_ADAPTIVE_DISABLE:
+		break;
+	default:
+		bad_command(c);
+		break;
+	}
+}
+
+// All arguments of `op` are in
+static void execute(void)
+{
+	state = st_opcode;
+
+	switch (op) {
+	case MPSSE_SET_BITS_LOW:
+		set_bits_low(args[0], args[1]);
+		break;
+	case MPSSE_TCK_DIVISOR:
+		set_clock(args[0] | (args[1] << 8));
+		break;
+	default:
+		// Data shifting, the length is encoded minus one
+		remaining = (args[0] | ((uint16_t)args[1] << 8)) + 1UL;
+		setup_spi();
+		state = st_data;
+		break;
+	}
+}
+
+// Runs commands until EP2 is empty or there is no room for read data
+static void run(void)
+{
+	for (;;) {
+		if (state == st_data && !(op & MPSSE_DO_WRITE)) {
+			// Clocking data in only, no bytes from the host needed
+			uint8_t n = in_room();
+			if (n > remaining)
+				n = remaining;
+			remaining -= n;
+			while (n--)
+				push(spi_xfer(0));
+			if (remaining)
+				return;
+			state = st_opcode;
+		}
+
+		// Worst case a bad command answer
+		if (in_room() < 2)
+			return;
+
+		EP_select(FtdiConfig::ep_out);
+		if (!Reg_UEINTX::any<_BV(RXOUTI)>())
+			return;
+
+		uint8_t avail = UEBCLX;
+		if (!avail) {
+			// Bank done, on to the next one
+			Reg_UEINTX::clear<bv(RXOUTI, FIFOCON)>();
+			continue;
+		}
+
+		if (state == st_data) {
+			uint8_t n = avail;
+			if (n > remaining)
+				n = remaining;
+
+			if (op & MPSSE_DO_READ) {
+				uint8_t room = in_room();
+				if (n > room)
+					n = room;
+				remaining -= n;
+				while (n--)
+					push(spi_xfer(UEDATX));
+			} else {
+				remaining -= n;
+				while (n--)
+					spi_xfer(UEDATX);
+			}
+			if (!remaining)
+				state = st_opcode;
+			continue;
+		}
+
+		uint8_t c = UEDATX;
+		if (state == st_opcode) {
+			opcode(c);
+		} else {
+			args[argc++] = c;
+			if (argc == 2)
+				execute();
+		}
+	}
+}
+
+void mpsse_start(void)
+{
+	state = st_opcode;
+	in_head = in_tail = 0;
+	flush = 0;
+	div5 = 1;
+
+	set_bits_low(0, 0);
+	set_clock(0);
+	SPCR = (1<<SPE) | (1<<MSTR) | spcr_clock;
+}
+
+void mpsse_stop(void)
+{
+	SPCR = 0;
+	SPSR = 0;
+	DDRB = 0;
+	PORTB = 0;
+}
+
+void mpsse_service(void)
+{
+	run();
+
+	// Read data -> EP1, right away after a send immediate
+	EP_select(FtdiConfig::ep_in);
+
+	if (Reg_UEINTX::any<_BV(TXINI)>()) {
+		uint8_t t = in_tail;
+		uint8_t n = (in_head - t) & (IN_SIZE - 1);
+
+		if (!n)
+			flush = 0; // nothing to send (anymore)
+
+		if (FtdiPersonality::in_packet_due(n) || flush) {
+			if (n > ftdi_in_payload)
+				n = ftdi_in_payload;
+
+			FtdiPersonality::send_reserved_bytes();
+			while (n--) {
+				UEDATX = in_buf[t];
+				t = (t + 1) & (IN_SIZE - 1);
+			}
+			in_tail = t;
+			Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();
+			FtdiPersonality::in_packet_sent();
+		}
+	}
+}
@@ -0,0 +1,43 @@
+#ifndef MPSSE_H
+#define MPSSE_H
+
+// Subset of the FTDI MPSSE command engine, on the SPI peripheral.
+//
+// Selected with SET_BITMODE, mode FTDI_BITMODE_MPSSE. The opcode stream arriving
+// on EP2 is parsed as it comes in, a command may span several packets and a
+// packet may hold many commands. Read data goes back on EP1.
+//
+// Supported (AN_108 numbering):
+//   0x10..0x3f  clock data bytes out and/or in, on either edge, MSB or LSB first
+//               (bit mode and TMS commands are not supported)
+//   0x80 / 0x81 set / read the low byte GPIO
+//   0x84 / 0x85 loopback on (not supported) / off
+//   0x86        set the clock divisor
+//   0x87        send immediate
+//   0x8a / 0x8b disable / enable the divide by 5 clock prescaler
+//   0x8d, 0x97  disable 3 phase clocking, turn off adaptive clocking (no-ops)
+// Anything else is answered with 0xfa followed by the opcode, like the FTDI
+// does for a bad command.
+//
+// Low byte pins on PORTB (Arduino Leonardo):
+//   ADBUS0 TCK/SK  PB1 (SCK)       ADBUS4..7 GPIOL0..3  PB4..PB7 (D8..D11)
+//   ADBUS1 TDI/DO  PB2 (MOSI)
+//   ADBUS2 TDO/DI  PB3 (MISO)
+//   ADBUS3 TMS/CS  PB0 (SS), always an output or the SPI would drop out of master mode
+//
+// The SPI mode of a data command follows from its edges and the idle level of
+// TCK set with 0x80, e.g. 0x11/0x31 with TCK low is SPI mode 0. The clock is the
+// fastest SPI clock (F_CPU/2 .. F_CPU/128) not above the MPSSE clock asked for.
+
+#include <stdint.h>
+
+// Starts the engine, all low byte pins inputs except CS
+void mpsse_start(void);
+
+// Turns the SPI off and makes all pins inputs again
+void mpsse_stop(void);
+
+// Main loop work: runs the commands on EP2, sends the results on EP1
+void mpsse_service(void);
+
+#endif // MPSSE_H
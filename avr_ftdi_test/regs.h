@@ -0,0 +1,125 @@
+#ifndef REGS_H
+#define REGS_H
+
+// Typed access to the I/O registers.
+//
+// Every register is a type, Reg<address>, with static inline accessors that take
+// their bit masks as template arguments. The masks are therefore always compile
+// time constants and several fields can be merged into one access:
+//
+//   Reg_UEINTX::clear<bv(TXINI, FIFOCON)>();         // one read-modify-write
+//   Reg_UDIEN::modify<_BV(SUSPE), _BV(WAKEUPE)>();    // one read-modify-write
+//   Reg_UECFG1X::write(usb_ep_cfg1(64, 1));           // one store, no read
+//
+// instead of one read-modify-write per bit with set_bit()/clear_bit().
+// A single bit set()/clear() on a register in the lower I/O space (PORTx, DDRx,
+// ...) compiles to sbi/cbi.
+//
+// The addresses are data space addresses taken from the register summary of the
+// ATmega32U4 datasheet. When not compiling for an AVR (host model/unit tests)
+// the registers map onto the `host_sfr` array instead, which the host build has
+// to provide (host/regs_test does).
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#define set_bit(REG, BIT) REG |= _BV(BIT)
+#define clear_bit(REG, BIT) REG &= ~_BV(BIT)
+#define toggle_bit(REG, BIT) REG ^= _BV(BIT)
+#define assign_bit(REG, BIT, VAL) do{if(VAL) set_bit(REG,BIT) else clear_bit(REG,BIT);}while(0)
+
+#ifndef __AVR__
+extern volatile uint8_t host_sfr[0x100];
+#endif
+
+// Mask with the given bit numbers set, usable as template argument: bv(TXINI, FIFOCON)
+static constexpr uint8_t bv()
+{
+	return 0;
+}
+
+template<typename... Bits>
+static constexpr uint8_t bv(uint8_t bit, Bits... bits)
+{
+	return (uint8_t)(_BV(bit) | bv(bits...));
+}
+
+template<uint16_t Addr>
+struct Reg
+{
+	// Data space address, for inline assembly (subtract __SFR_OFFSET for in/out)
+	static const uint16_t addr = Addr;
+
+	static inline volatile uint8_t &ref()
+	{
+#ifdef __AVR__
+		return *(volatile uint8_t *)Addr;
+#else
+		return host_sfr[Addr];
+#endif
+	}
+
+	static inline uint8_t read() { return ref(); }
+
+	// Plain store, nothing is read back
+	static inline void write(uint8_t v) { ref() = v; }
+
+	// Set/clear all bits of Mask in one access
+	template<uint8_t Mask> static inline void set() { ref() |= Mask; }
+	template<uint8_t Mask> static inline void clear() { ref() &= (uint8_t)~Mask; }
+
+	// Clear the bits in ClearMask and set the bits in SetMask in one access
+	template<uint8_t ClearMask, uint8_t SetMask>
+	static inline void modify() { ref() = (ref() & (uint8_t)~ClearMask) | SetMask; }
+
+	// True if any bit of Mask is set
+	template<uint8_t Mask> static inline bool any() { return ref() & Mask; }
+
+	// Spin until any bit of Mask is set
+	template<uint8_t Mask> static inline void wait() { while (!(ref() & Mask)) {} }
+};
+
+// Ports (bit operations on these compile to sbi/cbi)
+typedef Reg<0x23> Reg_PINB;
+typedef Reg<0x24> Reg_DDRB;
+typedef Reg<0x25> Reg_PORTB;
+typedef Reg<0x26> Reg_PINC;
+typedef Reg<0x27> Reg_DDRC;
+typedef Reg<0x28> Reg_PORTC;
+typedef Reg<0x29> Reg_PIND;
+typedef Reg<0x2A> Reg_DDRD;
+typedef Reg<0x2B> Reg_PORTD;
+typedef Reg<0x2F> Reg_PINF;
+
+// Clock
+typedef Reg<0x49> Reg_PLLCSR;
+typedef Reg<0x52> Reg_PLLFRQ;
+
+// USART1
+typedef Reg<0xC8> Reg_UCSR1A;
+typedef Reg<0xC9> Reg_UCSR1B;
+typedef Reg<0xCA> Reg_UCSR1C;
+typedef Reg<0xCE> Reg_UDR1;
+
+// USB controller
+typedef Reg<0xD7> Reg_UHWCON;
+typedef Reg<0xD8> Reg_USBCON;
+typedef Reg<0xD9> Reg_USBSTA;
+typedef Reg<0xE0> Reg_UDCON;
+typedef Reg<0xE1> Reg_UDINT;
+typedef Reg<0xE2> Reg_UDIEN;
+typedef Reg<0xE3> Reg_UDADDR;
+
+// USB endpoints (all operate on the endpoint selected by UENUM)
+typedef Reg<0xE8> Reg_UEINTX;
+typedef Reg<0xE9> Reg_UENUM;
+typedef Reg<0xEB> Reg_UECONX;
+typedef Reg<0xEC> Reg_UECFG0X;
+typedef Reg<0xED> Reg_UECFG1X;
+typedef Reg<0xEE> Reg_UESTA0X;
+typedef Reg<0xF0> Reg_UEIENX;
+typedef Reg<0xF1> Reg_UEDATX;
+typedef Reg<0xF2> Reg_UEBCLX;
+typedef Reg<0xF3> Reg_UEBCHX;
+
+#endif // REGS_H
@@ -4,4 +4,24 @@
 // CPU frequency [Hz], the Arduino Leonardo board's clock has a frequency of 16 [MHz]
 #define F_CPU 16000000
 
+// Timer1 based ISR/handler timing histograms (see timing.h), Debug builds only
+#ifndef NDEBUG
+#define ENABLE_TIMING
+#endif
+
+// Debug text (boot messages, USB trace characters, see fmt.h) on the regular
+// USART. That USART carries the bridged serial data, and on an RS-485 bus or
+// inside a CRC'd frame a stray character is corrupted traffic, so this is off
+// in both builds. Only turn it on for a build that is never used as a bridge.
+//#define ENABLE_CONSOLE
+
+// Programming window [ms]: this long after reset a host setting 1200 baud (the
+// "1200 baud touch" of the Arduino tools) restarts the board into its bootloader.
+// The device enumerates normally meanwhile. 0 disables the window.
+#define PROG_WINDOW_MS 2000
+
+// How the bootloader (Caterina on the Leonardo) recognizes a requested restart
+#define BOOTKEY_ADDR 0x0800
+#define BOOTKEY 0x7777
+
 #endif
@@ -0,0 +1,20 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "tick.h"
+
+volatile uint16_t tick_count;
+
+ISR(TIMER0_COMPA_vect)
+{
+	tick_count++;
+}
+
+void tick_init(void)
+{
+	// CTC mode, clk/64, so OCR0A+1 counts of 4 us each (at 16 MHz)
+	TCCR0A = (1<<WGM01);
+	TCCR0B = (1<<CS01) | (1<<CS00);
+	OCR0A = F_CPU / 64 / TICK_HZ - 1;
+	TIMSK0 = (1<<OCIE0A);
+}
@@ -0,0 +1,39 @@
+#ifndef TICK_H
+#define TICK_H
+
+// 1 ms system tick from Timer0, for timeouts that must not block the main
+// loop the way _delay_ms() does.
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Tick frequency [Hz]
+#define TICK_HZ 1000
+
+// Milliseconds since tick_init(), wraps around after 65.5 s.
+// Compare with (uint16_t)(tick_now() - start) >= timeout.
+extern volatile uint16_t tick_count;
+
+// Starts Timer0 in CTC mode with an interrupt every 1/TICK_HZ seconds
+void tick_init(void);
+
+// Reads tick_count, which takes two instructions and must not be torn by the tick ISR
+static inline uint16_t tick_now(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t t = tick_count;
+	SREG = sreg;
+	return t;
+}
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
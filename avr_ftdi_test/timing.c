@@ -0,0 +1,94 @@
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "timing.h"
+
+#ifdef ENABLE_TIMING
+
+static timing_hist hist[TIMING_NUM_PROBES];
+
+volatile uint16_t timing_overflows;
+
+// Cost of an empty TIMING_ENTER/TIMING_EXIT pair, subtracted from every measurement
+static uint16_t overhead;
+
+void timing_reset(void)
+{
+	// One probe at a time, so the USART RX interrupt isn't held off for long
+	for (uint8_t i = 0; i < TIMING_NUM_PROBES; i++) {
+		uint8_t sreg = SREG;
+		cli();
+		memset(&hist[i], 0, sizeof(hist[i]));
+		hist[i].min = 0xffff;
+		SREG = sreg;
+	}
+}
+
+void timing_init(void)
+{
+	// Timer1: normal mode, no prescaler, overflow interrupt only.
+	// It wraps around every 65536 cycles (4.096 ms at 16 MHz).
+	uint8_t sreg = SREG;
+	cli();
+	TCCR1A = 0;
+	TCCR1B = (1<<CS10);
+	TCNT1 = 0;
+	TIFR1 = (1<<TOV1);
+	TIMSK1 = (1<<TOIE1);
+	timing_overflows = 0;
+	SREG = sreg;
+
+	uint32_t t0 = timing_now();
+	overhead = timing_since(t0);
+
+	timing_reset();
+}
+
+// Counts the Timer1 wraps for timing_now
+ISR(TIMER1_OVF_vect)
+{
+	timing_overflows++;
+}
+
+void timing_record(uint8_t probe, uint16_t cycles)
+{
+	timing_hist *h = &hist[probe];
+
+	// 0xffff stands for "longer than that", keep it
+	if (cycles != 0xffff)
+		cycles = cycles > overhead ? cycles - overhead : 0;
+
+	if (cycles < h->min)
+		h->min = cycles;
+	if (cycles > h->max)
+		h->max = cycles;
+	if (h->count != 0xffff)
+		h->count++;
+
+	// bucket = floor(log2(cycles)), start with the high byte to keep this short
+	uint8_t b = 0;
+	if (cycles & 0xff00) {
+		b = 8;
+		cycles >>= 8;
+	}
+	while (cycles >>= 1)
+		b++;
+
+	if (h->bucket[b] != 0xffff)
+		h->bucket[b]++;
+}
+
+uint8_t timing_get(uint8_t probe, timing_hist *out)
+{
+	if (probe >= TIMING_NUM_PROBES)
+		return 0;
+
+	uint8_t sreg = SREG;
+	cli();
+	*out = hist[probe];
+	SREG = sreg;
+	return 1;
+}
+
+#endif
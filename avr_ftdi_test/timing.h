@@ -0,0 +1,116 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+// Cycle-accurate timing histograms.
+//
+// Timer1 runs free at clk/1, so one tick is one CPU cycle (62.5 ns at 16 MHz).
+// It wraps every 4.096 ms; its overflow interrupt counts the wraps, so a path
+// that takes longer (a control request waiting for the host) is recorded as
+// 0xffff cycles instead of as whatever is left after the wrap.
+// Interesting code paths are bracketed with TIMING_ENTER / TIMING_EXIT, which
+// accumulate min/max and a log2 histogram of the elapsed cycles per probe.
+// The histograms can be read by the host with the FW_REQ_GET_TIMING vendor request.
+//
+// Everything compiles away in Release builds (NDEBUG defined), see settings.h.
+//
+// NOTE: an ISR is timestamped after its prologue has run, so the pushes done by
+// the compiler are not included in the ISR figures. The time spent in a main loop
+// handler does include any interrupts that happened to fire meanwhile.
+
+#include "settings.h"
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Code paths that can be timed
+enum {
+	TIMING_USB_GEN_ISR = 0,
+	TIMING_USART1_RX_ISR,
+	TIMING_HANDLE_CONTROL,
+	TIMING_HANDLE_INCOMING,
+	TIMING_HANDLE_OUTGOING,
+	TIMING_USB_INIT, // Usb::init(), once per boot
+	TIMING_BOOT_TO_ATTACH, // start of main() until the pull up is connected, once per boot
+	TIMING_BITBANG_ISR, // Timer3 compare A in the bit bang modes
+	TIMING_UART_RX_BURST, // polled USART -> EP1 bursts, counts only above 500 kbaud
+	TIMING_UART_TX_BURST, // polled EP2 -> USART bursts, counts only above 500 kbaud
+	TIMING_NUM_PROBES
+};
+
+// Bucket N counts durations of 2^N .. 2^(N+1)-1 cycles (bucket 0 also counts 0 cycles)
+#define TIMING_NUM_BUCKETS 16
+
+// Statistics of one probe, as sent to the host (little endian)
+typedef struct
+{
+	uint16_t min, max; // [cycles]
+	uint16_t count; // saturates at 0xffff
+	uint16_t bucket[TIMING_NUM_BUCKETS]; // saturate at 0xffff
+} __attribute__((packed)) timing_hist;
+
+#ifdef ENABLE_TIMING
+
+// Starts Timer1 from 0 and clears all histograms
+void timing_init(void);
+
+// Clears all histograms
+void timing_reset(void);
+
+// Adds one measurement to the histogram of `probe`
+void timing_record(uint8_t probe, uint16_t cycles);
+
+// Copies the histogram of `probe` (interrupt safe), returns 0 if there is no such probe
+uint8_t timing_get(uint8_t probe, timing_hist *out);
+
+// Timer1 overflows since timing_init()
+extern volatile uint16_t timing_overflows;
+
+// Reads Timer1 and its overflow count as one 32-bit time. The 16-bit read goes
+// through the shared TEMP register, so it must not be interrupted by an ISR that
+// reads Timer1 as well.
+static inline uint32_t timing_now(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	uint16_t t = TCNT1;
+	uint16_t ov = timing_overflows;
+	// An overflow whose interrupt hasn't run yet (interrupts are off): if TCNT1
+	// reads low it wrapped before the read
+	if ((TIFR1 & _BV(TOV1)) && t < 0x8000)
+		ov++;
+	SREG = sreg;
+	return ((uint32_t)ov << 16) | t;
+}
+
+// Cycles since `t0` (a timing_now() value), 0xffff if it was longer than that
+static inline uint16_t timing_since(uint32_t t0)
+{
+	uint32_t d = timing_now() - t0;
+	return d > 0xffff ? 0xffff : d;
+}
+
+#define TIMING_ENTER(P) uint32_t timing_t0_##P = timing_now()
+#define TIMING_EXIT(P) timing_record(P, timing_since(timing_t0_##P))
+
+// Records the cycles since timing_init() for probe P, 0xffff from 4.096 ms on
+#define TIMING_SINCE_INIT(P) timing_record(P, timing_since(0))
+
+#else
+
+#define timing_init() do{}while(0)
+#define timing_reset() do{}while(0)
+#define TIMING_ENTER(P) do{}while(0)
+#define TIMING_EXIT(P) do{}while(0)
+#define TIMING_SINCE_INIT(P) do{}while(0)
+
+#endif
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -1,25 +1,876 @@
 #include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include <stdio.h>
 #include "uart.h"
+#include "crc.h"
+#include "tick.h"
+#include "timing.h"
 
-void USART_SendByte(uint8_t u8Data){
+// Transmit ring, filled by USART_SendByte and drained by the UDRE interrupt.
+// Indices are 8 bits and wrap with UART_TX_SIZE-1 as mask.
+static volatile uint8_t tx_buf[UART_TX_SIZE];
+static volatile uint8_t tx_head; // next free slot, written by main code
+static volatile uint8_t tx_tail; // next byte to send, written by the ISR
 
-	// Wait until last byte has been transmitted
-	while((UCSR1A &(1<<UDRE1)) == 0);
+volatile uint16_t uart_tx_dropped;
 
-	// Transmit data
-	UDR1 = u8Data;
+// Receive ring, filled by the RX complete interrupt.
+// 256 entries, so the 8-bit indices wrap around by themselves.
+static volatile uint8_t rx_buf[256];
+static volatile uint8_t rx_head; // next free slot, written by the ISR
+static volatile uint8_t rx_tail; // next byte to read, written by main code
+
+volatile uint8_t uart_rx_errors;
+volatile uint16_t uart_rx_overruns;
+
+int16_t uart_baud_error;
+
+uint16_t uart_char_cycles;
+
+// Polls per idle character time in uart_rx_burst, one poll takes about 8 cycles
+static uint8_t idle_polls;
+
+// Idle gaps, as receive ring positions of the first byte after them. Latched
+// by the RX interrupt when a byte arrives with OCF3A already set, or by
+// uart_rx_gap when it polls the flag during the gap, whichever comes first.
+// 8-bit indices, the queue holds UART_GAP_QUEUE ends.
+#define UART_GAP_QUEUE 4
+static volatile uint8_t gap_queue[UART_GAP_QUEUE];
+static volatile uint8_t gap_qhead, gap_qtail;
+// The last gap latched, the flag comes back every gap while the line stays idle
+static volatile uint8_t gap_end;
+
+// RS-485 driver enable states
+#define RS485_IDLE 0 // DE off
+#define RS485_PRE 1 // DE on, waiting for the pre guard time to pass
+#define RS485_ACTIVE 2 // DE on, sending
+#define RS485_POST 3 // last stop bit out, waiting for the post guard time to pass
+static volatile uint8_t rs485_state;
+static uint8_t rs485_pre_bits, rs485_post_bits;
+static uint8_t rs485_pre_ticks, rs485_post_ticks; // [Timer0 ticks of 4 us]
+
+uint8_t uart_rs485;
+
+// 9-bit mode: the ninth bit of every transmit ring entry, and the address filter
+static volatile uint8_t tx_bit8[UART_TX_SIZE / 8];
+static uint8_t rx_addr, rx_addr_mask;
+
+uint8_t uart_9bit;
+
+#define UART_ABS(X) ((X) < 0 ? -(X) : (X))
+// U2X halves the clock divider (8 instead of 16), only use it when it is more accurate
+#define UART_USE_U2X(B) (UART_ABS(UART_ERROR(B, 8)) < UART_ABS(UART_ERROR(B, 16)))
+
+// Bit 15 of `ubrr` in the baud rate table: set U2X1
+#define UART_U2X_FLAG 0x8000
+
+#define UART_BAUD_ENTRY(B) { \
+	B, \
+	UART_USE_U2X(B) ? (UART_UBRR(B, 8) | UART_U2X_FLAG) : UART_UBRR(B, 16), \
+	UART_USE_U2X(B) ? UART_ERROR(B, 8) : UART_ERROR(B, 16) \
+}
+
+typedef struct
+{
+	uint32_t baud;
+	uint16_t ubrr; // UBRR value, UART_U2X_FLAG if U2X1 has to be set
+	int16_t error; // [0.01 %]
+} uart_baud_entry;
+
+// Settings for common baud rates, all worked out by the compiler.
+// With F_CPU = 16 MHz the 250k, 500k, 1M and 2M rates are exact.
+static const uart_baud_entry baud_table[] PROGMEM = {
+	UART_BAUD_ENTRY(9600UL),
+	UART_BAUD_ENTRY(19200UL),
+	UART_BAUD_ENTRY(38400UL),
+	UART_BAUD_ENTRY(57600UL),
+	UART_BAUD_ENTRY(115200UL),
+	UART_BAUD_ENTRY(230400UL),
+	UART_BAUD_ENTRY(250000UL),
+	UART_BAUD_ENTRY(500000UL),
+	UART_BAUD_ENTRY(1000000UL),
+	UART_BAUD_ENTRY(2000000UL),
+};
+
+// Works out UBRR and the error [0.01 %] for clock divider `div` at run time.
+// Returns 0 if the baud rate can't be reached with this divider.
+static uint8_t calc_baud(uint32_t baud, uint8_t div, uint16_t *ubrr, int16_t *error)
+{
+	uint32_t d = div * baud;
+	uint32_t u = (F_CPU + d / 2) / d;
+
+	if (u < 1 || u > 4096)
+		return 0;
+
+	int32_t diff = (int32_t)(F_CPU / (div * u)) - (int32_t)baud;
+
+	*ubrr = u - 1;
+	// keep diff * 10000 within 32 bits, anything that far off is useless anyway
+	if (diff > 200000L || diff < -200000L)
+		*error = diff > 0 ? INT16_MAX : INT16_MIN;
+	else
+		*error = diff * 10000L / (int32_t)baud;
+	return 1;
+}
+
+#if (UART_TX_SIZE & (UART_TX_SIZE-1)) || UART_TX_SIZE > 256
+#  error UART_TX_SIZE must be a power of two, at most 256
+#endif
+
+// Data register empty: feed the next byte from the ring to the USART
+ISR(USART1_UDRE_vect)
+{
+	uint8_t t = tx_tail;
+
+	if (t == tx_head) {
+		// Ring empty, stop interrupting until USART_SendByte queues something
+		UCSR1B &= ~(1<<UDRIE1);
+		return;
+	}
+
+	// The ninth bit has to be in place before UDR1 is written
+	if (uart_9bit) {
+		if (tx_bit8[t >> 3] & (1 << (t & 7)))
+			UCSR1B |= (1<<TXB81);
+		else
+			UCSR1B &= ~(1<<TXB81);
+	}
+	UDR1 = tx_buf[t];
+	tx_tail = (t + 1) & (UART_TX_SIZE - 1);
+}
+
+// Clears a pending transmit complete. U2X1 and MPCM1 share the register, the
+// other flags are cleared by writing 1 or read only.
+#define UART_CLEAR_TXC() (UCSR1A = (UCSR1A & ((1<<U2X1)|(1<<MPCM1))) | (1<<TXC1))
+
+// Guard times in Timer0 ticks, at the current baud rate. Rounded up, plus one
+// tick as TCNT0 may advance right after rs485_timer read it.
+static void rs485_guard_ticks(void)
+{
+	uint16_t bit_cycles = uart_char_cycles / 10;
+	uint32_t pre = ((uint32_t)rs485_pre_bits * bit_cycles + 63) / 64;
+	uint32_t post = ((uint32_t)rs485_post_bits * bit_cycles + 63) / 64;
+	uint8_t top = OCR0A;
+
+	rs485_pre_ticks = !rs485_pre_bits ? 0 : pre >= top ? top : pre + 1;
+	rs485_post_ticks = !rs485_post_bits ? 0 : post >= top ? top : post + 1;
+}
+
+// Starts the one shot guard timer, 1 <= ticks <= OCR0A, interrupts off
+static void rs485_timer(uint8_t ticks)
+{
+	uint8_t top = OCR0A;
+	uint16_t m = TCNT0 + ticks;
+
+	if (m > top)
+		m -= top + 1;
+	OCR0B = m;
+	TIFR0 = (1<<OCF0B);
+	TIMSK0 |= (1<<OCIE0B);
+}
+
+// Something was queued, get it sent. Interrupts off. `was_empty`: the ring was
+// empty before, so the transmitter may have been idle.
+static void rs485_send(uint8_t was_empty)
+{
+	switch (rs485_state) {
+	case RS485_PRE:
+		// The end of the pre guard time starts sending
+		return;
+	case RS485_IDLE:
+		UART_DE_PORT |= (1<<UART_DE_BIT);
+		if (rs485_pre_ticks) {
+			rs485_state = RS485_PRE;
+			rs485_timer(rs485_pre_ticks);
+			return;
+		}
+		break;
+	case RS485_POST:
+		// DE is still on, no need to wait again
+		TIMSK0 &= ~(1<<OCIE0B);
+		break;
+	}
+
+	// A transmit complete from before the pause doesn't belong to this byte.
+	// UDRE has priority over TXC, so it could load the byte first and leave
+	// the stale TXC to drop DE in the middle of it.
+	if (was_empty)
+		UART_CLEAR_TXC();
+	rs485_state = RS485_ACTIVE;
+	UCSR1B |= (1<<UDRIE1);
+}
+
+// Transmit complete: the last stop bit is out, release the RS-485 driver
+ISR(USART1_TX_vect)
+{
+	// More bytes are queued or about to be loaded
+	if (rs485_state != RS485_ACTIVE || (UCSR1B & (1<<UDRIE1)))
+		return;
+
+	if (rs485_post_ticks) {
+		rs485_state = RS485_POST;
+		rs485_timer(rs485_post_ticks);
+	} else {
+		UART_DE_PORT &= ~(1<<UART_DE_BIT);
+		rs485_state = RS485_IDLE;
+	}
+}
+
+// RS-485 guard time passed
+ISR(TIMER0_COMPB_vect)
+{
+	TIMSK0 &= ~(1<<OCIE0B);
+
+	if (rs485_state == RS485_PRE) {
+		UART_CLEAR_TXC();
+		rs485_state = RS485_ACTIVE;
+		UCSR1B |= (1<<UDRIE1);
+	} else if (rs485_state == RS485_POST) {
+		UART_DE_PORT &= ~(1<<UART_DE_BIT);
+		rs485_state = RS485_IDLE;
+	}
+}
+
+void uart_set_rs485(uint8_t on, uint8_t pre_bits, uint8_t post_bits)
+{
+	uint8_t sreg = SREG;
+	cli();
+
+	rs485_pre_bits = pre_bits;
+	rs485_post_bits = post_bits;
+	rs485_guard_ticks();
+
+	TIMSK0 &= ~(1<<OCIE0B);
+	UCSR1B &= ~(1<<TXCIE1);
+	UART_DE_PORT &= ~(1<<UART_DE_BIT);
+	rs485_state = RS485_IDLE;
+	uart_rs485 = on;
+
+	if (on) {
+		UART_DE_DDR |= (1<<UART_DE_BIT);
+		// A transmission in progress carries on with the driver on
+		if (UCSR1B & (1<<UDRIE1)) {
+			UART_DE_PORT |= (1<<UART_DE_BIT);
+			rs485_state = RS485_ACTIVE;
+		}
+		UART_CLEAR_TXC();
+		UCSR1B |= (1<<TXCIE1);
+	} else {
+		UART_DE_DDR &= ~(1<<UART_DE_BIT);
+		// Bytes held back by a pre guard time go now
+		if (tx_head != tx_tail)
+			UCSR1B |= (1<<UDRIE1);
+	}
+
+	SREG = sreg;
+}
+
+// Queues the gap before ring position `h`, interrupts off. When the queue
+// is full the gap is lost and the frames around it merge.
+static inline void gap_latch(uint8_t h)
+{
+	if (h == gap_end)
+		return;
+	gap_end = h;
+
+	uint8_t q = gap_qhead;
+	if ((uint8_t)(q - gap_qtail) < UART_GAP_QUEUE) {
+		gap_queue[q & (UART_GAP_QUEUE - 1)] = h;
+		gap_qhead = q + 1;
+	}
+}
+
+#ifdef ENABLE_TIMING
+
+// 9-bit mode: stores an address character or a data 0xFF escaped, filters
+// the addresses
+static inline void rx_escaped(uint8_t bit8, uint8_t c)
+{
+	uint8_t seq[3] = { UART_9BIT_ESC, UART_9BIT_ESC_FF, c };
+	uint8_t n = 2;
+
+	if (bit8) {
+		uint8_t a = UCSR1A & (1<<U2X1);
+		if ((c & rx_addr_mask) != rx_addr) {
+			// Another node's: MPCM1 drops its data characters in hardware
+			UCSR1A = a | (1<<MPCM1);
+			return;
+		}
+		UCSR1A = a;
+		seq[1] = UART_9BIT_ESC_ADDR;
+		n = 3;
+	}
+
+	uint8_t h = rx_head;
+	if ((uint8_t)(rx_tail - h - 1) < n) {
+		uart_rx_overruns++;
+		return;
+	}
+	for (uint8_t i = 0; i < n; i++)
+		rx_buf[h++] = seq[i];
+	rx_head = h;
+}
+
+// Receive complete: move the byte into the ring
+ISR(USART1_RX_vect)
+{
+	TIMING_ENTER(TIMING_USART1_RX_ISR);
+
+	// The line was idle for the gap before this byte, which starts a new frame
+	if ((TIFR3 & (1<<OCF3A)) && (GPIOR0 & (1<<UART_GAP_FLAG)))
+		gap_latch(rx_head);
+
+	// The error flags and the ninth bit belong to the byte in UDR1, so read them first
+	uint8_t status = UCSR1A & ((1<<FE1)|(1<<DOR1)|(1<<UPE1));
+	uint8_t bit8 = UCSR1B & (1<<RXB81);
+	uint8_t c = UDR1;
+	uint8_t h = rx_head;
+
+	uart_rx_errors |= status;
+
+	if ((GPIOR0 & (1<<UART_9BIT_FLAG)) && (bit8 || c == UART_9BIT_ESC)) {
+		rx_escaped(bit8, c);
+	} else if ((uint8_t)(h + 1) == rx_tail) {
+		uart_rx_overruns++;
+	} else {
+		rx_buf[h] = c;
+		rx_head = h + 1;
+	}
+
+	// Restart the gap timer
+	if (GPIOR0 & (1<<UART_GAP_FLAG)) {
+		TCNT3 = 0;
+		TIFR3 = (1<<OCF3A);
+	}
+
+	TIMING_EXIT(TIMING_USART1_RX_ISR);
+}
+
+#else
+
+// Receive complete: the same as the C version above, but it saves only the
+// registers it uses (the compiler's version also saves r0/r1 and clears r1).
+// Cycles from the vector to the instruction after reti, counted from the
+// instruction set manual and checked with simavr by host/rx_isr_cycles:
+//
+//   jmp at the vector                          3
+//   save r24, SREG, r25, r30, r31             11
+//   no gap before the byte (OCF3A clear)       2
+//   latch error flags                          8
+//   9-bit mode off                             2
+//   read UDR1                                  2
+//   full check                                 7
+//   store, advance head                        9
+//   gap timer off | restart (framed mode)      3 | 9
+//   restore, reti                             15
+//                                             --
+//   byte stored                               62 cycles
+//   ring full (counted in uart_rx_overruns)   66 cycles
+//   framed mode                               +6 cycles
+//   first byte after an idle gap (latched)   +34 cycles, framed mode only
+//
+// The interrupt response of the CPU (at least 4 cycles) comes on top, so a
+// stored byte takes about 4.2 us at 16 MHz.
+//
+// 9-bit mode, counted only: data characters other than 0xFF take 9 cycles
+// more, an escaped 0xFF 35 more and an address character for this node 65
+// more (a character is 11 bits then). An address character for another node
+// takes 5 more, the data characters after it cost nothing at all.
+//
+// At 2 Mbaud a byte takes 80 cycles, so the receiver keeps up with a
+// continuous stream as long as nothing blocks interrupts for long.
+ISR(USART1_RX_vect, ISR_NAKED)
+{
+	asm volatile(
+		"push r24\n\t"
+		"in r24, __SREG__\n\t"
+		"push r24\n\t"
+		"push r25\n\t"
+		"push r30\n\t"
+		"push r31\n\t"
+
+		// The line was idle for the gap before this byte (framed mode)
+		"sbic %[tifr], %[ocf]\n\t"
+		"rcall 20f\n\t"
+
+		// The error flags belong to the byte in UDR1, so read them first
+		"lds r24, %[ucsra]\n\t"
+		"andi r24, %[errmask]\n\t"
+		"lds r25, %[errors]\n\t"
+		"or r25, r24\n\t"
+		"sts %[errors], r25\n\t"
+		// 9-bit mode out of line, the ninth bit has to be read before UDR1
+		"sbic %[gpior], %[nineflag]\n\t"
+		"rjmp 5f\n\t"
+		"lds r25, %[udr]\n"
+
+		// Full when head + 1 == tail
+		"4:\n\t"
+		"lds r30, %[head]\n\t"
+		"lds r24, %[tail]\n\t"
+		"dec r24\n\t"
+		"cp r24, r30\n\t"
+		"breq 1f\n\t"
+
+		// rx_buf[head] = byte; head++ (wraps by itself)
+		"mov r24, r30\n\t"
+		"inc r24\n\t"
+		"ldi r31, 0\n\t"
+		"subi r30, lo8(-(%[buf]))\n\t"
+		"sbci r31, hi8(-(%[buf]))\n\t"
+		"st Z, r25\n\t"
+		"sts %[head], r24\n"
+
+		// Restart the gap timer, TCNT3 high byte first
+		"2:\n\t"
+		"sbis %[gpior], %[gapflag]\n\t"
+		"rjmp 3f\n\t"
+		"ldi r24, 0\n\t"
+		"sts %[tcnt]+1, r24\n\t"
+		"sts %[tcnt], r24\n\t"
+		"sbi %[tifr], %[ocf]\n"
+
+		"3:\n\t"
+		"pop r31\n\t"
+		"pop r30\n\t"
+		"pop r25\n\t"
+		"pop r24\n\t"
+		"out __SREG__, r24\n\t"
+		"pop r24\n\t"
+		"reti\n"
+
+		// Ring full, out of line to keep the common path short
+		"1:\n\t"
+		"lds r24, %[overruns]\n\t"
+		"lds r25, %[overruns]+1\n\t"
+		"adiw r24, 1\n\t"
+		"sts %[overruns]+1, r25\n\t"
+		"sts %[overruns], r24\n\t"
+		"rjmp 2b\n"
+
+		// 9-bit mode: plain data characters join the common path
+		"5:\n\t"
+		"lds r24, %[ucsrb]\n\t"
+		"lds r25, %[udr]\n\t"
+		"sbrc r24, %[rxb8]\n\t"
+		"rjmp 6f\n\t"
+		"cpi r25, %[esc]\n\t"
+		"breq 7f\n\t"
+		"rjmp 4b\n"
+
+		// Data 0xFF: ESC, ESC_FF
+		"7:\n\t"
+		"lds r24, %[tail]\n\t"
+		"lds r30, %[head]\n\t"
+		"sub r24, r30\n\t"
+		"subi r24, 1\n\t"
+		"cpi r24, 2\n\t"
+		"brsh 8f\n\t"
+		"rjmp 1b\n"
+		"8:\n\t"
+		"mov r24, r30\n\t"
+		"rcall 9f\n\t"
+		"ldi r25, %[escff]\n\t"
+		"rcall 9f\n\t"
+		"sts %[head], r24\n\t"
+		"rjmp 2b\n"
+
+		// Address character: MPCM1 drops the data of other nodes in hardware,
+		// ours is let through (U2X1 kept, TXC1 not cleared)
+		"6:\n\t"
+		"lds r31, %[ucsra]\n\t"
+		"andi r31, %[u2x]\n\t"
+		"lds r24, %[amask]\n\t"
+		"and r24, r25\n\t"
+		"lds r30, %[addr]\n\t"
+		"cp r24, r30\n\t"
+		"breq 10f\n\t"
+		"ori r31, %[mpcm]\n\t"
+		"sts %[ucsra], r31\n\t"
+		"rjmp 2b\n"
+		"10:\n\t"
+		"sts %[ucsra], r31\n\t"
+
+		// ESC, ESC_ADDR, address
+		"lds r24, %[tail]\n\t"
+		"lds r30, %[head]\n\t"
+		"sub r24, r30\n\t"
+		"subi r24, 1\n\t"
+		"cpi r24, 3\n\t"
+		"brsh 11f\n\t"
+		"rjmp 1b\n"
+		"11:\n\t"
+		"mov r24, r30\n\t"
+		"push r25\n\t"
+		"ldi r25, %[esc]\n\t"
+		"rcall 9f\n\t"
+		"ldi r25, %[escaddr]\n\t"
+		"rcall 9f\n\t"
+		"pop r25\n\t"
+		"rcall 9f\n\t"
+		"sts %[head], r24\n\t"
+		"rjmp 2b\n"
+
+		// rx_buf[r24++] = r25
+		"9:\n\t"
+		"mov r30, r24\n\t"
+		"ldi r31, 0\n\t"
+		"subi r30, lo8(-(%[buf]))\n\t"
+		"sbci r31, hi8(-(%[buf]))\n\t"
+		"st Z, r25\n\t"
+		"inc r24\n\t"
+		"ret\n"
+
+		// gap_latch(rx_head), if gap detection is on
+		"20:\n\t"
+		"sbis %[gpior], %[gapflag]\n\t"
+		"ret\n\t"
+		"lds r24, %[head]\n\t"
+		"lds r25, %[gapend]\n\t"
+		"cp r24, r25\n\t"
+		"breq 21f\n\t"
+		"sts %[gapend], r24\n\t"
+		"lds r30, %[qhead]\n\t"
+		"lds r25, %[qtail]\n\t"
+		"mov r31, r30\n\t"
+		"sub r31, r25\n\t"
+		"cpi r31, %[qsize]\n\t"
+		"brsh 21f\n\t"
+		"mov r25, r30\n\t"
+		"inc r25\n\t"
+		"sts %[qhead], r25\n\t"
+		"andi r30, %[qsize]-1\n\t"
+		"ldi r31, 0\n\t"
+		"subi r30, lo8(-(%[queue]))\n\t"
+		"sbci r31, hi8(-(%[queue]))\n\t"
+		"st Z, r24\n"
+		"21:\n\t"
+		"ret\n\t"
+		:
+		: [ucsra] "n" (_SFR_MEM_ADDR(UCSR1A)),
+		  [udr] "n" (_SFR_MEM_ADDR(UDR1)),
+		  [errmask] "M" ((1<<FE1)|(1<<DOR1)|(1<<UPE1)),
+		  [errors] "i" (&uart_rx_errors),
+		  [overruns] "i" (&uart_rx_overruns),
+		  [head] "i" (&rx_head),
+		  [tail] "i" (&rx_tail),
+		  [buf] "i" (rx_buf),
+		  [gpior] "I" (_SFR_IO_ADDR(GPIOR0)),
+		  [gapflag] "I" (UART_GAP_FLAG),
+		  [tcnt] "n" (_SFR_MEM_ADDR(TCNT3)),
+		  [tifr] "I" (_SFR_IO_ADDR(TIFR3)),
+		  [ocf] "I" (OCF3A),
+		  [nineflag] "I" (UART_9BIT_FLAG),
+		  [ucsrb] "n" (_SFR_MEM_ADDR(UCSR1B)),
+		  [rxb8] "I" (RXB81),
+		  [esc] "M" (UART_9BIT_ESC),
+		  [escff] "M" (UART_9BIT_ESC_FF),
+		  [escaddr] "M" (UART_9BIT_ESC_ADDR),
+		  [u2x] "M" (1<<U2X1),
+		  [mpcm] "M" (1<<MPCM1),
+		  [amask] "i" (&rx_addr_mask),
+		  [addr] "i" (&rx_addr),
+		  [gapend] "i" (&gap_end),
+		  [qhead] "i" (&gap_qhead),
+		  [qtail] "i" (&gap_qtail),
+		  [queue] "i" (gap_queue),
+		  [qsize] "M" (UART_GAP_QUEUE)
+	);
+}
+
+#endif
+
+uint8_t uart_available(void)
+{
+	return rx_head - rx_tail;
+}
+
+void uart_set_gap(uint16_t us)
+{
+	// The RX interrupt leaves Timer3 alone from here on
+	GPIOR0 &= ~(1<<UART_GAP_FLAG);
+	TIMSK3 = 0;
+	TCCR3B = 0;
+	TIFR3 = (1<<OCF3A);
+	gap_qhead = gap_qtail = 0;
+
+	if (!us)
+		return;
+
+	// Timer3: CTC mode, clk/64 (4 us), no interrupt
+	uint16_t ticks = (us + 3) / 4;
+	TCCR3A = 0;
+	OCR3A = ticks > 1 ? ticks - 1 : 1;
+	TCNT3 = 0;
+	TIFR3 = (1<<OCF3A);
+	gap_end = rx_head;
+	TCCR3B = (1<<WGM32) | (1<<CS31) | (1<<CS30);
+
+	GPIOR0 |= (1<<UART_GAP_FLAG);
+}
+
+uint8_t uart_rx_gap(uint8_t *end)
+{
+	uint8_t sreg = SREG;
+	cli();
+	// The line is idle right now: latch the gap without waiting for the next
+	// byte. One that arrives now, with its interrupt still pending, is after
+	// the gap anyway.
+	if ((TIFR3 & (1<<OCF3A)) && (GPIOR0 & (1<<UART_GAP_FLAG))) {
+		TIFR3 = (1<<OCF3A);
+		gap_latch(rx_head);
+	}
+
+	uint8_t t = gap_qtail;
+	uint8_t gap = t != gap_qhead;
+	if (gap) {
+		*end = gap_queue[t & (UART_GAP_QUEUE - 1)];
+		gap_qtail = t + 1;
+	}
+	SREG = sreg;
+
+	return gap;
+}
+
+uint8_t uart_rx_before(uint8_t end)
+{
+	return end - rx_tail;
+}
+
+uint8_t uart_rx_head(void)
+{
+	return rx_head;
+}
+
+uint16_t uart_rx_crc(uint16_t crc, uint8_t from, uint8_t end, uint8_t type)
+{
+	uint8_t i = from;
+
+	while (i != end)
+		crc = crc_update(type, crc, rx_buf[i++]);
+	return crc;
+}
+
+void uart_rx_skip(uint8_t end)
+{
+	rx_tail = end;
+}
+
+uint8_t uart_read(uint8_t *buf, uint8_t max, uint16_t timeout_ticks)
+{
+	uint8_t n = 0;
+	uint16_t start = tick_now();
+
+	while (n < max) {
+		uint8_t t = rx_tail;
+
+		if (t == rx_head) {
+			// Nothing (more) received, wait unless the time is up
+			if ((uint16_t)(tick_now() - start) >= timeout_ticks)
+				break;
+			continue;
+		}
+
+		buf[n++] = rx_buf[t];
+		rx_tail = t + 1;
+	}
+	return n;
+}
+
+uint8_t uart_drain_to(volatile uint8_t *dst, uint8_t max)
+{
+	uint8_t t = rx_tail;
+	uint8_t n = rx_head - t;
+
+	if (n > max)
+		n = max;
+	for (uint8_t i = n; i; i--)
+		*dst = rx_buf[t++];
+	rx_tail = t;
+	return n;
+}
+
+uint8_t uart_rx_burst(volatile uint8_t *dst, uint8_t max)
+{
+	// Interrupt off first, or bytes could end up in the ring after newer ones were polled
+	uint8_t sreg = SREG;
+	cli();
+	UCSR1B &= ~(1<<RXCIE1);
+	SREG = sreg;
+
+	uint8_t n = uart_drain_to(dst, max);
+	uint16_t idle = 0;
+
+	while (n < max) {
+		uint8_t status = UCSR1A;
+
+		if (status & (1<<RXC1)) {
+			// The error flags belong to the byte in UDR1, so read them first
+			uart_rx_errors |= status & ((1<<FE1)|(1<<DOR1)|(1<<UPE1));
+			*dst = UDR1;
+			n++;
+			idle = 0;
+		} else if (++idle >= 2 * idle_polls) {
+			break;
+		}
+	}
+
+	// A byte that came in meanwhile is taken by the ISR right away
+	cli();
+	UCSR1B |= (1<<RXCIE1);
+	SREG = sreg;
+	return n;
+}
+
+void uart_tx_burst(volatile uint8_t *src, uint8_t n)
+{
+	uint8_t sreg = SREG;
+	cli();
+	UCSR1B &= ~(1<<UDRIE1);
+	SREG = sreg;
+
+	// Whatever is queued goes first. An ISR calling USART_SendByte turns the
+	// UDRE interrupt back on, which then sends from the ring too, so take
+	// each byte and write it without letting it in between.
+	for (;;) {
+		cli();
+		uint8_t t = tx_tail;
+		if (t == tx_head)
+			break;
+		if (UCSR1A & (1<<UDRE1)) {
+			UDR1 = tx_buf[t];
+			tx_tail = (t + 1) & (UART_TX_SIZE - 1);
+		}
+		SREG = sreg;
+	}
+	SREG = sreg;
+
+	while (n--) {
+		uint8_t c = *src;
+
+		// An ISR calling USART_SendByte re-enables the UDRE interrupt,
+		// so check and write without letting it in between
+		for (;;) {
+			cli();
+			if (UCSR1A & (1<<UDRE1))
+				break;
+			SREG = sreg;
+		}
+		UDR1 = c;
+		SREG = sreg;
+	}
+}
+
+uint8_t uart_tx_free(void)
+{
+	return (tx_tail - tx_head - 1) & (UART_TX_SIZE - 1);
+}
+
+// USART_SendByte with the ninth bit. The slot is taken and filled with
+// interrupts off: with the console on, put_char also runs in the USB_GEN
+// bottom half, which has interrupts enabled and can preempt a main loop
+// producer in the middle of this.
+static uint8_t tx_queue(uint8_t c, uint8_t bit8)
+{
+	uint8_t sreg = SREG;
+	uint8_t h, next;
+
+	for (;;) {
+		cli();
+		h = tx_head;
+		next = (h + 1) & (UART_TX_SIZE - 1);
+		if (next != tx_tail)
+			break;
+
+		// Ring full
+#if UART_TX_FULL == UART_TX_BLOCK
+		// Only wait when the UDRE interrupt is able to make room, that is
+		// never inside an ISR or another section with interrupts disabled.
+		if (sreg & (1<<SREG_I)) {
+			SREG = sreg;
+			while (next == tx_tail)
+				;
+			continue;
+		}
+#endif
+#if UART_TX_FULL != UART_TX_DROP
+		uart_tx_dropped++;
+#endif
+		SREG = sreg;
+		return 0;
+	}
+
+	tx_buf[h] = c;
+	if (uart_9bit) {
+		if (bit8)
+			tx_bit8[h >> 3] |= 1 << (h & 7);
+		else
+			tx_bit8[h >> 3] &= ~(1 << (h & 7));
+	}
+
+	// Publish the byte and make sure the UDRE interrupt is on
+	uint8_t was_empty = h == tx_tail;
+	tx_head = next;
+	if (uart_rs485)
+		rs485_send(was_empty);
+	else
+		UCSR1B |= (1<<UDRIE1);
+	SREG = sreg;
+
+	return 1;
+}
+
+uint8_t USART_SendByte(uint8_t u8Data){
+	return tx_queue(u8Data, 0);
+}
+
+uint8_t uart_send_address(uint8_t addr)
+{
+	return tx_queue(addr, 1);
+}
+
+void uart_set_9bit(uint8_t on, uint8_t addr, uint8_t mask)
+{
+	uint8_t sreg = SREG;
+	cli();
+
+	rx_addr_mask = on ? mask : 0;
+	rx_addr = addr & rx_addr_mask;
+	uart_9bit = on;
+
+	// Until our address comes by, only address characters get through
+	uint8_t a = UCSR1A & (1<<U2X1);
+	if (rx_addr_mask)
+		a |= (1<<MPCM1);
+	UCSR1A = a;
+
+	if (on) {
+		UCSR1B |= (1<<UCSZ12);
+		GPIOR0 |= (1<<UART_9BIT_FLAG);
+	} else {
+		UCSR1B &= ~((1<<UCSZ12)|(1<<TXB81));
+		GPIOR0 &= ~(1<<UART_9BIT_FLAG);
+	}
+
+	SREG = sreg;
 }
 
 
-// not being used but here for completeness
 // Wait until a byte has been received and return received data
 uint8_t USART_ReceiveByte(){
-	while((UCSR1A &(1<<RXC1)) == 0);
-	return UDR1;
+	while (rx_head == rx_tail)
+		;
+
+	uint8_t t = rx_tail;
+	uint8_t c = rx_buf[t];
+	rx_tail = t + 1;
+	return c;
 }
 
 
+#ifdef ENABLE_CONSOLE
+
 int printCHAR(char character, FILE *stream)
 {
 	USART_SendByte(character);
@@ -29,18 +880,101 @@ int printCHAR(char character, FILE *stream)
 // "FILE" descriptor for use with regular USART
 FILE uart_str = FDEV_SETUP_STREAM(printCHAR, NULL, _FDEV_SETUP_RW);
 
-void USART_Init(void){
-   // Set baud rate
-   UBRR1L = BAUD_PRESCALE;// Load lower 8-bits into the low byte of the UBRR register
-   UBRR1H = (BAUD_PRESCALE >> 8); 
-	/* Load upper 8-bits into the high byte of the UBRR register
-    Default frame format is 8 data bits, no parity, 1 stop bit
-	to change use UCSRC, see AVR datasheet*/ 
+#endif
+
+int16_t USART_SetBaud(uint32_t baud){
+	uint16_t ubrr = 0;
+	int16_t error = INT16_MAX;
+
+	for (uint8_t i = 0; i < sizeof(baud_table)/sizeof(baud_table[0]); i++) {
+		if (pgm_read_dword(&baud_table[i].baud) == baud) {
+			ubrr = pgm_read_word(&baud_table[i].ubrr);
+			error = pgm_read_word(&baud_table[i].error);
+			break;
+		}
+	}
+
+	if (error == INT16_MAX) {
+		// Not in the table, do the math
+		uint16_t ubrr2x;
+		int16_t error2x;
+		uint8_t ok = calc_baud(baud, 16, &ubrr, &error);
+
+		if (calc_baud(baud, 8, &ubrr2x, &error2x)
+			&& (!ok || UART_ABS(error2x) < UART_ABS(error))) {
+			ubrr = ubrr2x | UART_U2X_FLAG;
+			error = error2x;
+		}
+	}
+
+	// Let the transmitter finish the character it is working on, UDR1 and the
+	// shift register: a divider change garbles it otherwise. Nothing new is
+	// loaded meanwhile, the queued bytes follow at the new rate.
+	uint8_t sreg = SREG;
+	cli();
+	uint8_t udrie = UCSR1B & (1<<UDRIE1);
+	UCSR1B &= ~(1<<UDRIE1);
+	SREG = sreg;
+
+	if (UCSR1B & (1<<TXEN1)) {
+		while (!(UCSR1A & (1<<UDRE1)))
+			;
+		// TXC1 sets once the character in the shift register is out. It stays
+		// clear if the shift register was empty already (and the TXC interrupt
+		// clears it with RS-485), so wait at most one character time at the
+		// old rate: 12 bits, and a loop pass takes more than 4 cycles.
+		uint16_t old = ((uint16_t)(UBRR1H & 0x0f) << 8) | UBRR1L;
+		uint32_t polls = 3UL * (old + 1) * ((UCSR1A & (1<<U2X1)) ? 8 : 16);
+		UART_CLEAR_TXC();
+		while (polls-- && !(UCSR1A & (1<<TXC1)))
+			;
+	}
+
+	// The RX interrupt writes MPCM1 in 9-bit mode, and writing a pending TXC1
+	// back as 1 would clear it
+	cli();
+	uint8_t a = UCSR1A & (1<<MPCM1);
+	if (ubrr & UART_U2X_FLAG)
+		a |= (1<<U2X1);
+	UCSR1A = a;
+	UBRR1H = (ubrr >> 8) & 0x0f; // Load upper 4-bits into the high byte of the UBRR register
+	UBRR1L = ubrr; // Load lower 8-bits into the low byte of the UBRR register
+
+	// Carry on with the queued bytes, the RS-485 driver may have been released
+	if (udrie && tx_head != tx_tail) {
+		if (uart_rs485)
+			rs485_send(1);
+		else
+			UCSR1B |= (1<<UDRIE1);
+	}
+	SREG = sreg;
+
+	// Cycles per character: 10 bits of (UBRR + 1) * 8 or 16 cycles each
+	uint32_t cycles = 10UL * ((ubrr & 0x0fff) + 1) * ((ubrr & UART_U2X_FLAG) ? 8 : 16);
+	uart_char_cycles = cycles > 0xffff ? 0xffff : cycles;
+	idle_polls = uart_char_cycles / 8 > 255 ? 255 : uart_char_cycles / 8;
+	rs485_guard_ticks();
+
+	uart_baud_error = error;
+	return error;
+}
+
+int16_t USART_Init(uint32_t baud){
+	/* Set baud rate
+	Default frame format is 8 data bits, no parity, 1 stop bit
+	to change use UCSRC, see AVR datasheet*/
+	int16_t error = USART_SetBaud(baud);
 
   // Enable receiver and transmitter and receive complete interrupt 
+  // (the data register empty interrupt is enabled once there is something to send)
   UCSR1B = ((1<<TXEN1)|(1<<RXEN1) | (1<<RXCIE1));
 
+#ifdef ENABLE_CONSOLE
   // Use our "FILE" descriptor for stdout, so `printCHAR" will be called whenever
-  // putchar or printf have something to say.
+  // putchar or printf have something to say. Without the console a stray printf
+  // goes nowhere instead of onto the bridged line.
   stdout = &uart_str; 
+#endif
+
+  return error;
 }
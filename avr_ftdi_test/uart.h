@@ -2,23 +2,180 @@
 #define uartH
 
 #include "settings.h"
+#include <stdint.h>
+#ifdef ENABLE_CONSOLE
+#include <stdio.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-// Define baud rate
-#define USART_BAUDRATE 9600
-#define BAUD_PRESCALE (((F_CPU / (USART_BAUDRATE * 16UL))) - 1)
+// Default baud rate
+#define USART_BAUDRATE 9600UL
+
+// UBRR value for baud rate B with clock divider DIV (16 normal speed, 8 with U2X), rounded
+#define UART_UBRR(B, DIV) ((F_CPU + (DIV)*(uint32_t)(B)/2) / ((DIV)*(uint32_t)(B)) - 1)
+// Baud rate actually achieved with that UBRR value
+#define UART_ACTUAL(B, DIV) (F_CPU / ((DIV) * (UART_UBRR(B, DIV) + 1)))
+// Relative error of the achieved baud rate [0.01 %]
+#define UART_ERROR(B, DIV) ((int16_t)(((int64_t)UART_ACTUAL(B, DIV) - (int64_t)(B)) * 10000 / (int64_t)(B)))
+
+// Size of the transmit ring [bytes], power of two, at most 256
+#define UART_TX_SIZE 128
+
+// What USART_SendByte does when the transmit ring is full
+#define UART_TX_DROP 0 // drop the byte
+#define UART_TX_COUNT 1 // drop the byte and count it in `uart_tx_dropped`
+#define UART_TX_BLOCK 2 // wait for room, but drop and count when interrupts are disabled (ISRs)
+#define UART_TX_FULL UART_TX_BLOCK
+
+// Number of bytes dropped because the transmit ring was full
+extern volatile uint16_t uart_tx_dropped;
+
+// Error flags (FE1, DOR1, UPE1 of UCSR1A) of all bytes received so far, clear by writing 0
+extern volatile uint8_t uart_rx_errors;
+
+// Number of bytes lost because the receive ring was full
+extern volatile uint16_t uart_rx_overruns;
+
+// Relative error of the current baud rate [0.01 %], as set by USART_Init/USART_SetBaud
+extern int16_t uart_baud_error;
+
+// Configures regular USART for `baud` baud, 8N1.
+// Returns the relative error of the achieved baud rate [0.01 %].
+int16_t USART_Init(uint32_t baud);
+
+// Changes the baud rate of the regular USART, picks U2X and UBRR with the
+// smallest error. The rates in the table in uart.c need no division at all.
+// Returns the relative error of the achieved baud rate [0.01 %].
+int16_t USART_SetBaud(uint32_t baud);
+
+// Queue byte for transmission over regular USART (interrupt driven),
+// returns 0 if it was dropped because the transmit ring was full.
+// In 9-bit mode it is a data character (ninth bit clear).
+uint8_t USART_SendByte(uint8_t u8Data);
+
+// Number of received bytes waiting in the receive ring
+uint8_t uart_available(void);
+
+// Moves up to `max` received bytes into `buf`, returns the number of bytes read.
+// Waits at most `timeout_ticks` ms (see tick.h) for more bytes to arrive;
+// with a timeout of 0 it never waits and only returns what is available already.
+uint8_t uart_read(uint8_t *buf, uint8_t max, uint16_t timeout_ticks);
+
+// Moves up to `max` received bytes into the register `dst` (e.g. an endpoint FIFO),
+// without waiting. Returns the number of bytes moved.
+uint8_t uart_drain_to(volatile uint8_t *dst, uint8_t max);
+
+// Number of bytes USART_SendByte can queue without the transmit ring being full
+uint8_t uart_tx_free(void);
+
+// Polled bursts, for sustained load at high baud rates where the interrupt
+// entry/exit per byte costs more than the byte itself. The interrupt of the
+// direction is off for the duration of the call only, so a burst must be
+// kept short: it is only worth it (and only allowed) if a character takes
+// at most UART_BURST_MAX_CHAR_CYCLES, 500 kbaud and up. In Debug builds the
+// TIMING_UART_RX_BURST and TIMING_UART_TX_BURST probes count the bursts, so
+// FW_REQ_GET_TIMING shows whether they run at a given rate.
+#define UART_BURST_MAX_CHAR_CYCLES 320
+
+// CPU cycles per character (10 bits) at the current baud rate
+extern uint16_t uart_char_cycles;
 
-// Configures regular USART for 9600 baud
-void USART_Init(void);
+// Moves up to `max` received bytes into the register `dst`: the bytes in the
+// receive ring first, then bytes polled straight from the USART. Stops early
+// once the line has been idle for two character times.
+// Returns the number of bytes moved.
+uint8_t uart_rx_burst(volatile uint8_t *dst, uint8_t max);
 
-// Send out byte over regular USART
-void USART_SendByte(uint8_t u8Data);
+// Sends `n` bytes read from the register `src` (e.g. an endpoint FIFO),
+// after the bytes still in the transmit ring. Waits until the last one has
+// been handed to the USART.
+void uart_tx_burst(volatile uint8_t *src, uint8_t n);
 
-// Output function for standard libs
+// Idle gap detection (framed mode): every received byte restarts Timer3, which
+// sets OCF3A once the line has been idle for the gap. The flag is polled, so
+// no interrupt is involved. The first byte after a gap latches it, so a gap
+// the main loop was too busy to see in time still ends the frame. Timer3 is
+// shared with the bit bang and other bulk modes, so the gap detection must be
+// off while one of those runs.
+// The RX interrupt only touches Timer3 while this GPIOR0 bit is set.
+#define UART_GAP_FLAG 0
+
+// Starts gap detection with a gap of `us` microseconds (4 us resolution), or
+// turns it off with 0
+void uart_set_gap(uint16_t us);
+
+// True once for every idle gap that followed received bytes, in order. `*end` is then
+// the receive ring position of the first byte after the gap, see uart_rx_before.
+uint8_t uart_rx_gap(uint8_t *end);
+
+// Number of bytes in the receive ring before ring position `end`
+uint8_t uart_rx_before(uint8_t end);
+
+// Receive ring position of the next byte to arrive
+uint8_t uart_rx_head(void);
+
+// Continues the CRC `crc` of type `type` (CRC_*, see crc.h) over the bytes
+// from ring position `from` up to `end`, which must all still be in the ring
+uint16_t uart_rx_crc(uint16_t crc, uint8_t from, uint8_t end, uint8_t type);
+
+// Drops the bytes in the receive ring before ring position `end`
+void uart_rx_skip(uint8_t end);
+
+// RS-485 half duplex: the driver enable pin (DE, with /RE tied to it) goes high
+// when there is something to send and low again once the last stop bit is
+// out (transmit complete interrupt). Optional guard times hold DE a number of
+// bit times before the first start bit and after the last stop bit. Timer0
+// compare B times them, in 4 us steps rounded up and at most 1 ms. Without a
+// post guard DE drops in the TXC interrupt itself, a few us after the stop bit.
+#define UART_DE_PORT PORTD
+#define UART_DE_DDR DDRD
+#define UART_DE_BIT PORTD4 // Leonardo D4
+
+// Nonzero while the driver enable pin is controlled
+extern uint8_t uart_rs485;
+
+// Turns driver enable control on or off, with guard times [bit times]
+void uart_set_rs485(uint8_t on, uint8_t pre_bits, uint8_t post_bits);
+
+// 9-bit frames for multi-drop buses, the ninth bit marks address characters.
+// With an address mask the multi-processor mode (MPCM1) filters the bus: once
+// an address character for another node went by, the USART ignores the data
+// characters that follow, they never even raise an interrupt. An address
+// character that matches (address & mask == own address) lets the data
+// through again and is passed on itself.
+//
+// The ninth bit is escaped in the byte stream, the same in both directions:
+//
+//   0xFF 0x00      data character 0xFF
+//   0xFF 0x01 a    address character a
+//   anything else  a data character
+//
+// The receive ring holds the escaped stream. The RX interrupt only looks for
+// the ninth bit while this GPIOR0 bit is set.
+#define UART_9BIT_FLAG 1
+#define UART_9BIT_ESC 0xff
+#define UART_9BIT_ESC_FF 0x00
+#define UART_9BIT_ESC_ADDR 0x01
+
+// Nonzero in 9-bit mode
+extern uint8_t uart_9bit;
+
+// Turns 9-bit frames on or off. `mask` 0 receives everything.
+void uart_set_9bit(uint8_t on, uint8_t addr, uint8_t mask);
+
+// Queues an address character (ninth bit set) in 9-bit mode, see USART_SendByte
+uint8_t uart_send_address(uint8_t addr);
+
+// Wait (forever) until a byte has been received and return it
+uint8_t USART_ReceiveByte(void);
+
+#ifdef ENABLE_CONSOLE
+// Output function for standard libs, stdout with the console on
 int printCHAR(char character, FILE *stream);
+#endif
 
 #ifdef __cplusplus
 };
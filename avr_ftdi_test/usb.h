@@ -110,6 +110,42 @@ typedef struct
 #define FTDI_SIO_GET_MODEM_STATUS	5
 #define FTDI_SIO_SET_LATENCY_TIMER	9
 #define FTDI_SIO_GET_LATENCY_TIMER	10
+#define FTDI_SIO_SET_BITMODE		0x0B /* wValue = bit mode << 8 | direction mask */
+#define FTDI_SIO_READ_PINS		0x0C /* Read the pins, 1 byte */
 #define FTDI_SIO_READ_EEPROM		0x90 /* Read EEPROM */
 
+// Bit modes (SET_BITMODE), as libftdi calls them
+#define FTDI_BITMODE_RESET		0x00 /* back to the serial converter */
+#define FTDI_BITMODE_BITBANG		0x01 /* asynchronous bit bang */
+#define FTDI_BITMODE_MPSSE		0x02
+#define FTDI_BITMODE_SYNCBB		0x04 /* synchronous bit bang */
+
+// Modem status bits (first byte of every IN packet). The low nibble is reserved
+// on the FT232BM (and masked by the Linux driver), the firmware uses bit 0.
+#define FTDI_MS_FRAME_END 0x01 /* the packet ends a frame (framed mode) */
+#define FTDI_MS_FRAME_BAD 0x02 /* ... with a wrong CRC (framed mode, see FW_REQ_SET_CRC) */
+
+// Line status bits (second byte of every IN packet)
+#define FTDI_LSR_OE 0x02 /* Overrun error */
+#define FTDI_LSR_PE 0x04 /* Parity error */
+#define FTDI_LSR_FE 0x08 /* Framing error */
+
+// Firmware specific vendor requests (not known to real FTDI chips)
+#define FW_REQ_GET_TIMING		0xA0 /* Read timing histogram, wIndex = probe */
+#define FW_REQ_RESET_TIMING		0xA1 /* Clear all timing histograms */
+#define FW_REQ_SET_MODE			0xA2 /* Use bulk endpoints for mode wValue, wIndex = mode parameter */
+#define FW_REQ_GET_BENCH		0xA3 /* Read benchmark counters */
+#define FW_REQ_ADC_CONFIG		0xA4 /* ADC channel for ftdi_mode_adc, wValue = channel | ADC_8BIT */
+#define FW_REQ_GET_ADC			0xA5 /* Read ADC stream counters */
+#define FW_REQ_LA_CONFIG		0xA6 /* wValue = port | channel mask << 8, wIndex = pre-trigger bytes */
+#define FW_REQ_LA_TRIGGER		0xA7 /* wValue = mask | value << 8, wIndex = trigger type */
+#define FW_REQ_GET_LA			0xA8 /* Read logic analyzer counters */
+#define FW_REQ_GEN_CONFIG		0xA9 /* Output for ftdi_mode_gen, wValue = output | pin mask << 8 */
+#define FW_REQ_GET_GEN			0xAA /* Read generator counters */
+#define FW_REQ_SET_FRAMING		0xAB /* wValue = idle gap that ends a frame [us], 0: off */
+#define FW_REQ_SET_RS485		0xAC /* wValue = pre | post guard << 8 [bit times], wIndex = 1: DE control on */
+#define FW_REQ_SET_9BIT			0xAD /* wValue = address | address mask << 8, wIndex = 1: 9-bit frames on */
+#define FW_REQ_SET_CRC			0xAE /* wValue = RX check | TX append << 8 (CRC_*), wIndex = 1: discard bad frames */
+#define FW_REQ_GET_CRC			0xAF /* Read framed mode CRC counters */
+
 #endif // USB_H
\ No newline at end of file
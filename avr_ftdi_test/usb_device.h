@@ -0,0 +1,600 @@
+#ifndef USB_DEVICE_H
+#define USB_DEVICE_H
+
+// Policy based driver for the ATmega32U4 USB device controller.
+//
+// Everything that used to be a #define or a file level global is a compile time
+// policy of the `Config` class given to UsbDevice<Config>:
+//
+//   struct MyConfig {
+//       static const uint8_t ep0_size = 64;     // 8, 16, 32 or 64 bytes
+//       static const uint8_t ep_in = 1;         // bulk IN endpoint number
+//       static const uint8_t ep_out = 2;        // bulk OUT endpoint number
+//       static const uint8_t bulk_size = 64;    // 8, 16, 32 or 64 bytes
+//       static const uint8_t in_banks = 1;      // 1 or 2 (double buffered)
+//       static const uint8_t out_banks = 1;     // 1 or 2 (double buffered)
+//       static const bool handle_suspend = false;
+//       static const uint8_t trace_level = usb_trace_all;
+//       typedef MyPersonality Personality;
+//   };
+//
+// The personality is what makes the device an FTDI (or something else), it
+// has to provide these static functions:
+//
+//   uint8_t get_desc(uint8_t type, uint8_t idx, const void **addr, uint8_t *len)
+//       Look up a descriptor in flash, return 1 if it exists.
+//   uint8_t control_in() / control_out()
+//       Handle the vendor/class request in UsbDevice<>::head, return 1 if ok.
+//       Data stage IN replies are written with UsbDevice<>::ctrl_write_*().
+//   void configured()
+//       Called after the host selected our configuration (bulk EPs are set up).
+//   void service()
+//       Called every main loop iteration to move bulk data around.
+//
+// All members are static and the whole class lives in this header, so the
+// compiler can inline and constant fold it. Policies that are switched off
+// (suspend handling, trace output) cost neither flash nor cycles.
+
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <avr/interrupt.h>
+#include "usb.h"
+#include "regs.h"
+#include "fmt.h"
+#include "timing.h"
+
+#define EP_select(N) do{Reg_UENUM::write((N)&0x07);}while(0)
+#define EP_read8() (UEDATX)
+#define EP_read16_le() ({uint16_t L, H; L=UEDATX; H=UEDATX; (H<<8)|L;})
+#define EP_write8(V) do{UEDATX = (V);}while(0)
+#define EP_write16_le(V) do{UEDATX=(V)&0xff;UEDATX=((V)>>8)&0xff;}while(0)
+
+// Prints the (flash) message `v` and halts if `a` is false, lives in avr_ftdi.cpp
+void oops(int a, PGM_P v);
+
+// Amount of debug characters mixed into the regular USART stream
+enum {
+	usb_trace_off = 0, // nothing
+	usb_trace_errors, // stalls, failures and unsupported requests
+	usb_trace_all // every step of the enumeration process
+};
+
+// UECFG1X value for an endpoint of `size` bytes and `banks` banks (with ALLOC set)
+static constexpr uint8_t usb_ep_cfg1(uint8_t size, uint8_t banks)
+{
+	return ((size==8 ? 0 : size==16 ? 1 : size==32 ? 2 : 3) << EPSIZE0)
+		| ((banks==2 ? 1 : 0) << EPBK0)
+		| _BV(ALLOC);
+}
+
+template<class Config>
+class UsbDevice
+{
+public:
+	typedef typename Config::Personality Personality;
+
+	static_assert(Config::ep0_size==8 || Config::ep0_size==16 || Config::ep0_size==32 || Config::ep0_size==64,
+		"EP0 size must be 8, 16, 32 or 64 bytes");
+	static_assert(Config::bulk_size==8 || Config::bulk_size==16 || Config::bulk_size==32 || Config::bulk_size==64,
+		"bulk endpoint size must be 8, 16, 32 or 64 bytes");
+	static_assert(Config::in_banks>=1 && Config::in_banks<=2 && Config::out_banks>=1 && Config::out_banks<=2,
+		"endpoints have 1 or 2 banks");
+
+	/* The control request currently being processed */
+	static usb_header head;
+
+	/* Configuration selected by the host (0: not configured) */
+	static uint8_t config;
+
+	// Debug character on the regular USART, if the trace level allows it
+	static inline void trace(uint8_t level, char c)
+	{
+		if (Config::trace_level >= level)
+			put_char(c);
+	}
+
+	// Performs initial USB and PLL configuration, the device stays detached
+	static void init();
+
+	// Connects the pull up, the host sees the device from now on
+	static inline void attach() { Reg_UDCON::clear<_BV(DETACH)>(); }
+
+	// Handles USB control messages and lets the personality move bulk data,
+	// call this from the main loop
+	static inline void poll()
+	{
+		EP_select(0);
+		if (Reg_UEINTX::any<_BV(RXSTPI)>())
+			handle_CONTROL();
+
+		Personality::service();
+	}
+
+	// Body of ISR(USB_GEN_vect), which has to be an ISR_BLOCK one: interrupts
+	// are enabled again once the USB general interrupts are masked
+	static inline void gen_isr();
+
+	// Setup the control endpoint. (may be called from ISR)
+	static void setupEP0(void);
+
+	// Write value from flash/RAM to EP0, returns 1 if the host aborted the transfer
+	static uint8_t ctrl_write_PM(const void *addr, uint16_t len) { return ctrl_write_mem(addr, len, true); }
+	static uint8_t ctrl_write_RAM(const void *addr, uint16_t len) { return ctrl_write_mem(addr, len, false); }
+
+	// Send a small reply (at most ep0_size bytes) from RAM to EP0
+	static void ctrl_reply(const void *addr, uint8_t len)
+	{
+		const uint8_t *p = (const uint8_t *)addr;
+		if (len > head.wLength)
+			len = head.wLength;
+		Reg_UEINTX::wait<_BV(TXINI)>();
+		while (len--)
+			EP_write8(*p++);
+		Reg_UEINTX::clear<_BV(TXINI)>();
+	}
+
+	/* function to write bytes of program memory to a bulk endpoint
+	BUG/LIMITATION: this function does not allow writing big chunks, because
+	the bulk endpoints in this program have a max size of 64 bytes */
+	static void bulk_write_PM(const void *addr, uint16_t len)
+	{
+		const uint8_t *p = (const uint8_t *)addr;
+		while(len--) {
+			UEDATX = pgm_read_byte(p);
+			p++;
+		}
+	}
+
+private:
+	static void configure_ep(uint8_t num, uint8_t cfg0, uint8_t cfg1);
+	static uint8_t ctrl_write_mem(const void *addr, uint16_t len, bool progmem);
+	static uint8_t USB_get_desc(void);
+	static void setup_other_ep();
+	static void USB_set_address(void);
+	static void USB_set_config(void);
+	static void dump_unsupported_request(void);
+	static void complete_status_stage(uint8_t ok);
+	static void usb_control_in(void);
+	static void usb_control_out(void);
+	static void handle_CONTROL(void);
+};
+
+template<class Config> usb_header UsbDevice<Config>::head;
+template<class Config> uint8_t UsbDevice<Config>::config;
+
+template<class Config>
+void UsbDevice<Config>::init()
+{
+	// No USB interrupts while the controller is set up
+	Reg_USBCON::write(0);
+	Reg_UDIEN::write(0);
+
+	// Enable USB pad regulator
+	Reg_UHWCON::write(_BV(UVREGE));
+
+	// 48 MHz USB clock: 16 MHz crystal / 2 (PINDIV) into the PLL, 96 MHz PLL
+	// output divided by 2. PLLTM1:0 stay 0, so Timer4 keeps running from the
+	// 16 MHz I/O clock (the PLL output would be above its 64 MHz limit). Then
+	// wait for the lock, about 100 us and by far the biggest part of the whole
+	// sequence.
+	Reg_PLLFRQ::write(_BV(PDIV3) | _BV(PDIV1) | _BV(PLLUSB));
+	Reg_PLLCSR::write(_BV(PINDIV) | _BV(PLLE));
+	Reg_PLLCSR::wait<_BV(PLOCK)>();
+
+	// Enable USB with the VBUS pad, the clock has to be unfrozen separately
+	Reg_USBCON::write(_BV(USBE) | _BV(OTGPADE) | _BV(FRZCLK));
+	Reg_USBCON::write(_BV(USBE) | _BV(OTGPADE));
+
+	// Full speed 12 Mbit/s, stay detached until attach()
+	Reg_UDCON::write(_BV(DETACH));
+
+	// The endpoints are still unconfigured after reset, EP0 is set up on the
+	// first end of reset from the host
+	if (Config::handle_suspend)
+		Reg_UDIEN::write(_BV(EORSTE) | _BV(SUSPE));
+	else
+		Reg_UDIEN::write(_BV(EORSTE));
+}
+
+// (Re)configure endpoint `num`, `cfg0`/`cfg1` are the UECFG0X/UECFG1X values.
+// Every register is written with a single store: the other UECONX bits are
+// strobes that ignore a 0, and UECFG1X is rewritten entirely anyway.
+template<class Config>
+void UsbDevice<Config>::configure_ep(uint8_t num, uint8_t cfg0, uint8_t cfg1)
+{
+	EP_select(num);
+
+	/* un-configure endpoint */
+	Reg_UECONX::write(0); // EPEN=0
+	Reg_UECFG1X::write(0); // ALLOC=0
+
+	/* configure endpoint */
+	Reg_UECONX::write(_BV(EPEN));
+	Reg_UECFG0X::write(cfg0);
+	Reg_UECFG1X::write(cfg1);
+
+	if(!Reg_UESTA0X::any<_BV(CFGOK)>()) {
+		trace(usb_trace_errors, '!');
+		while(1) {} /* oops */
+	}
+}
+
+template<class Config>
+void UsbDevice<Config>::setupEP0(void)
+{
+	/* EPs assumed to be configured in increasing order */
+	configure_ep(0, 0 /* CONTROL */, usb_ep_cfg1(Config::ep0_size, 1));
+}
+
+template<class Config>
+void UsbDevice<Config>::setup_other_ep()
+{
+	configure_ep(Config::ep_in, 0x81 /* BULK, IN */, usb_ep_cfg1(Config::bulk_size, Config::in_banks));
+	configure_ep(Config::ep_out, 0x80 /* BULK, OUT */, usb_ep_cfg1(Config::bulk_size, Config::out_banks));
+
+	EP_select(0);
+}
+
+// Split in a top half that runs with interrupts disabled and a bottom half
+// that doesn't block the other interrupts. At 2 Mbaud the USART receiver
+// overflows 3 byte times (15 us) after a byte arrived, far less than what
+// reconfiguring EP0 and a trace character take.
+template<class Config>
+void UsbDevice<Config>::gen_isr()
+{
+	TIMING_ENTER(TIMING_USB_GEN_ISR);
+
+	// Top half: take and acknowledge the events, then mask the USB general
+	// interrupts so this ISR can't re-enter itself while interrupts are enabled
+	uint8_t status = Reg_UDINT::read();
+	uint8_t enabled = Reg_UDIEN::read();
+	Reg_UDINT::write(~status); // writing 0 clears, 1 has no effect
+	Reg_UDIEN::write(0);
+	uint8_t ep = Reg_UENUM::read();
+	sei();
+
+	// Bottom half, USART RX (and the other ISRs) may preempt it
+	trace(usb_trace_all, 'I');
+	if (Config::handle_suspend) {
+		if(bit_is_set(status, SUSPI))
+		{
+			/* USB Suspend */
+
+			/* prepare for wakeup */
+			enabled = (enabled & ~_BV(SUSPE)) | _BV(WAKEUPE);
+
+			Reg_USBCON::set<_BV(FRZCLK)>(); /* freeze */
+		}
+		if(bit_is_set(status, WAKEUPI))
+		{
+			/* USB wakeup */
+			Reg_USBCON::clear<_BV(FRZCLK)>(); /* unfreeze */
+
+			enabled = (enabled & ~_BV(WAKEUPE)) | _BV(SUSPE);
+		}
+	}
+	if(bit_is_set(status, EORSTI))
+	{
+		/* coming out of USB reset */
+
+		if (Config::handle_suspend)
+			enabled = (enabled & ~_BV(SUSPE)) | _BV(WAKEUPE);
+
+		trace(usb_trace_all, 'E');
+		setupEP0();
+	}
+
+	// The main loop may have been in the middle of an endpoint access
+	cli();
+	Reg_UENUM::write(ep);
+	Reg_UDIEN::write(enabled);
+	TIMING_EXIT(TIMING_USB_GEN_ISR);
+}
+
+template<class Config>
+uint8_t UsbDevice<Config>::ctrl_write_mem(const void *addr, uint16_t len, bool progmem)
+{
+	const uint8_t *p = (const uint8_t *)addr;
+
+	while(len) {
+		uint8_t ntx = Config::ep0_size,
+				bsize = UEBCLX,
+				epintreg = UEINTX;
+
+		oops(ntx>=bsize, PSTR("EP")); /* ep0_size is wrong */
+
+		ntx -= bsize;
+		if(ntx>len)
+			ntx = len;
+
+		if(bit_is_set(epintreg, RXSTPI))
+			return 1; /* another SETUP has started, abort this one */
+		if(bit_is_set(epintreg, RXOUTI))
+			break; /* stop early? (len computed improperly?) */
+
+		/* Retry until can send */
+		if(bit_is_clear(epintreg, TXINI))
+			continue;
+		oops(ntx>0, PSTR("Ep")); /* ep0_size is wrong (or logic error?) */
+
+		len -= ntx;
+
+		while(ntx) {
+			uint8_t val = progmem ? pgm_read_byte(p) : *p;
+			EP_write8(val);
+			p++;
+			ntx--;
+		}
+
+		Reg_UEINTX::clear<_BV(TXINI)>();
+	}
+	return 0;
+}
+
+/* Handle the standard Get Descriptor request.
+ * Return 1 on success
+ */
+template<class Config>
+uint8_t UsbDevice<Config>::USB_get_desc(void)
+{
+	const void *addr;
+	uint8_t len;
+
+	if (!Personality::get_desc(head.wValue>>8, head.wValue&0xff, &addr, &len))
+		return 0;
+
+	if(len>head.wLength)
+		len = head.wLength;
+
+	return !ctrl_write_PM(addr, len);
+}
+
+/* Handle standard Set Address request */
+template<class Config>
+void UsbDevice<Config>::USB_set_address(void)
+{
+	Reg_UDADDR::write(head.wValue&0x7f);
+
+	Reg_UEINTX::clear<_BV(TXINI)>(); /* send 0 length reply */
+	Reg_UEINTX::wait<_BV(TXINI)>(); /* wait until sent */
+
+	Reg_UDADDR::write(_BV(ADDEN) | (head.wValue&0x7f));
+
+	Reg_UEINTX::clear<_BV(TXINI)>(); /* magic packet? */
+}
+
+template<class Config>
+void UsbDevice<Config>::USB_set_config(void)
+{
+	config = head.wValue;
+
+	setup_other_ep();
+	Personality::configured();
+}
+
+// Called when we encounter an 'alien' USB request/message so we can work out what
+// is needed to support it
+template<class Config>
+void UsbDevice<Config>::dump_unsupported_request(void)
+{
+	if (Config::trace_level < usb_trace_errors)
+		return;
+
+	put_char('?');
+	put_hex8(head.bmReqType);
+	put_hex8(head.bReq);
+	put_hex16(head.wLength);
+}
+
+// Ack (or STALL) the request in `head` once it has been handled
+template<class Config>
+void UsbDevice<Config>::complete_status_stage(uint8_t ok)
+{
+	if(ok) {
+		if(head.bmReqType&ReqType_DirD2H) {
+			/* Control read.
+			 * Wait for, and complete, status
+			 */
+			uint8_t sts;
+			while(!((sts=Reg_UEINTX::read())&bv(RXSTPI, RXOUTI))) {}
+			//loop_until_bit_is_set(UEINTX, RXOUTI);
+			ok = (sts & _BV(RXOUTI));
+			if(!ok) {
+				Reg_UECONX::set<_BV(STALLRQ)>();
+				trace(usb_trace_errors, 'S');
+			} else {
+				Reg_UEINTX::clear<bv(RXOUTI, TXINI)>();
+			}
+		} else {
+			/* Control write.
+			 * indicate completion
+			 */
+			Reg_UEINTX::clear<_BV(TXINI)>();
+		}
+		trace(usb_trace_all, 'C');
+
+	} else {
+		/* fail un-handled SETUP */
+		Reg_UECONX::set<_BV(STALLRQ)>();
+		trace(usb_trace_errors, 'F');
+	}
+}
+
+// Handles CONTROL reads (Atmel to pc)
+template<class Config>
+void UsbDevice<Config>::usb_control_in(void)
+{
+	// Flag that indicates whether the request was supported and should be ack'ed.
+	// If at the end of the function it is false, then a the endpoint is STALLed
+	uint8_t ok = 0;
+
+	if ((head.bmReqType & ReqType_TypeMask) != ReqType_TypeStd) {
+		// Vendor (or class) specific, up to the personality
+		ok = Personality::control_in();
+		if (!ok)
+			dump_unsupported_request();
+		complete_status_stage(ok);
+		return;
+	}
+
+	switch(head.bReq)
+	{
+	case usb_req_set_feature:
+	case usb_req_clear_feature:
+		/* No features to handle.
+		 * We ignore Remote wakeup,
+		 * and EP0 will never be Halted
+		 */
+		ok = 1;
+		break;
+	case usb_req_get_status:
+		switch(head.bmReqType) {
+		case USB_REQ_TYPE_IN:
+		case USB_REQ_TYPE_IN | USB_REQ_TYPE_INTERFACE:
+		case USB_REQ_TYPE_IN | USB_REQ_TYPE_ENDPOINT:
+			// always status 0
+			Reg_UEINTX::wait<_BV(TXINI)>();
+			EP_write16_le(0);
+			Reg_UEINTX::clear<_BV(TXINI)>();
+			ok = 1;
+		}
+		break;
+	case usb_req_set_address:
+		// This is an 'out' command, so should be handled by 'usb_control_out' instead
+		break;
+	case usb_req_get_desc:
+		if(head.bmReqType==0x80) {
+			ok = USB_get_desc();
+		}
+		break;
+	case usb_req_set_config:
+		if(head.bmReqType==0) {
+			config = head.wValue;
+			ok = 1;
+		}
+		break;
+	case usb_req_get_config:
+		if(head.bmReqType==USB_REQ_TYPE_IN) {
+			Reg_UEINTX::wait<_BV(TXINI)>();
+			EP_write8(config);
+			Reg_UEINTX::clear<_BV(TXINI)>();
+			ok = 1;
+		}
+		break;
+	case usb_req_set_iface:
+		break;
+	case usb_req_get_iface:
+		break;
+	case usb_req_set_desc:
+		break;
+	case usb_req_synch_frame:
+		break;
+
+	default:
+		dump_unsupported_request();
+	}
+
+	complete_status_stage(ok);
+}
+
+// Handles CONTROL writes (pc to Atmel)
+template<class Config>
+void UsbDevice<Config>::usb_control_out(void)
+{
+	uint8_t ok = 0;
+
+	if ((head.bmReqType & ReqType_TypeMask) != ReqType_TypeStd) {
+		// Vendor (or class) specific, up to the personality
+		ok = Personality::control_out();
+		if (!ok)
+			dump_unsupported_request();
+		complete_status_stage(ok);
+		return;
+	}
+
+	switch(head.bReq)
+	{
+	case usb_req_set_feature:
+	case usb_req_clear_feature:
+		/* No features to handle.
+		 * We ignore Remote wakeup,
+		 * and EP0 will never be Halted
+		 */
+		ok = 1;
+		break;
+	case usb_req_get_status:
+		// This is an 'in' command, so should be handled by `usb_control_in` instead
+		break;
+	case usb_req_set_address:
+		if(head.bmReqType==USB_REQ_TYPE_OUT) {
+			// Host sets USB address
+			trace(usb_trace_all, 'A');
+			USB_set_address();
+			trace(usb_trace_all, 'a');
+
+			return;
+		}
+		break;
+	case usb_req_get_desc:
+		// This is an 'in' command, so should be handled by 'usb_control_in' instead
+		break;
+	case usb_req_set_config:
+		if(head.bmReqType==0) {
+			trace(usb_trace_all, 'S');
+			USB_set_config();
+			trace(usb_trace_all, 's');
+			ok = 1;
+		}
+		break;
+	case usb_req_get_config:
+		break;
+	case usb_req_set_iface:
+		break;
+	case usb_req_get_iface:
+		break;
+	case usb_req_set_desc:
+		break;
+	case usb_req_synch_frame:
+		break;
+
+	default:
+		dump_unsupported_request();
+	}
+
+	complete_status_stage(ok);
+}
+
+// Called when the pc/laptop is quizzing/configuring the Atmel
+template<class Config>
+void UsbDevice<Config>::handle_CONTROL(void)
+{
+	TIMING_ENTER(TIMING_HANDLE_CONTROL);
+	/* SETUP message */
+	head.bmReqType = EP_read8();
+	head.bReq = EP_read8();
+	head.wValue = EP_read16_le();
+	head.wIndex = EP_read16_le();
+	head.wLength = EP_read16_le();
+
+	/* ack. first stage of CONTROL.
+	 * Clears buffer for IN/OUT data
+	 */
+	Reg_UEINTX::clear<_BV(RXSTPI)>();
+
+	/* despite what the figure in
+	 * 21.12.2 (Control Read) would suggest,
+	 * SW should not clear TXINI here
+	 * as doing so will send a zero length
+	 * response.
+	 */
+
+	if (head.bmReqType & USB_REQ_TYPE_IN)
+		usb_control_in();
+	else
+		usb_control_out();
+
+	TIMING_EXIT(TIMING_HANDLE_CONTROL);
+}
+
+#endif // USB_DEVICE_H
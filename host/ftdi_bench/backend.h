@@ -0,0 +1,81 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+// Ways of talking to the emulated FTDI device.
+//
+// A backend moves payload bytes: the two status bytes the device puts in front
+// of every IN packet are already stripped off by the time read() returns.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <chrono>
+
+// Bulk endpoint modes of the firmware (ftdi_mode_* in avr_ftdi_test/ftdi.h)
+enum {
+	mode_uart = 0, // USB to serial bridge, needs TXD1 wired to RXD1 for loopback tests
+	mode_loopback = 1, // firmware loopback EP2 -> EP1, USART bypassed
+	mode_prbs_gen = 2,
+	mode_prbs_check = 3,
+};
+
+// Timing probes of a Debug firmware (TIMING_* in avr_ftdi_test/timing.h)
+enum {
+	probe_uart_rx_burst = 8, // polled USART -> EP1 bursts
+	probe_uart_tx_burst = 9, // polled EP2 -> USART bursts
+};
+
+class Backend
+{
+public:
+	virtual ~Backend() {}
+
+	// Returns false (and fills `error`) if the device can't be used
+	virtual bool open(std::string &error) = 0;
+
+	// FTDI latency timer [ms]
+	virtual bool set_latency(uint8_t ms) = 0;
+
+	virtual bool set_baud(uint32_t baud) = 0;
+
+	// Firmware specific bulk endpoint mode (FW_REQ_SET_MODE), not every backend can
+	virtual bool set_mode(uint8_t mode, uint16_t param) = 0;
+
+	// Returns the number of bytes written/read, or -1 on error.
+	// read() returns early when `len` bytes arrived or `timeout_ms` passed.
+	virtual int write(const uint8_t *buf, size_t len, int timeout_ms) = 0;
+	virtual int read(uint8_t *buf, size_t len, int timeout_ms) = 0;
+
+	// Debug firmware only: clears the timing histograms, and reads how often
+	// probe `probe` fired since (FW_REQ_RESET_TIMING, FW_REQ_GET_TIMING)
+	virtual bool reset_timing() { return false; }
+	virtual bool timing_count(uint8_t probe, unsigned &count)
+	{
+		(void)probe;
+		(void)count;
+		return false;
+	}
+
+	virtual std::string name() const = 0;
+
+	// Time base for the measurements [us]. The model runs on a virtual clock.
+	virtual uint64_t now_us()
+	{
+		using namespace std::chrono;
+		return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+	}
+};
+
+// In-process model of the firmware in loopback mode, for CI runs without a board
+Backend *make_model_backend();
+
+// Linux ftdi_sio tty, e.g. /dev/ttyUSB0
+Backend *make_tty_backend(const std::string &path);
+
+// Direct USB access with libusb (nullptr if built without it)
+Backend *make_libusb_backend();
+
+// FTDI (FT232BM) baud rate divisor encoding, value for wValue | wIndex << 16
+uint32_t ftdi_baud_divisor(uint32_t baud);
+
+#endif // BACKEND_H
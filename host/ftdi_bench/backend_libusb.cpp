@@ -0,0 +1,163 @@
+// libusb backend, talks the FTDI protocol to the device directly.
+//
+// This is the only backend that can switch the firmware mode (FW_REQ_SET_MODE),
+// so it is the one to use for the firmware loopback and PRBS measurements.
+// Built only when HAVE_LIBUSB is defined (the Makefile does so if pkg-config
+// finds libusb-1.0).
+
+#include "backend.h"
+
+#ifdef HAVE_LIBUSB
+
+#include <libusb.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+const uint16_t vid = 0x0403, pid = 0x6001;
+const uint8_t ep_in = 0x81, ep_out = 0x02;
+const size_t packet_size = 64;
+
+// Requests, see usb.h of the firmware
+const uint8_t req_set_baud_rate = 0x03;
+const uint8_t req_set_latency_timer = 0x09;
+const uint8_t req_get_timing = 0xA0;
+const uint8_t req_reset_timing = 0xA1;
+const uint8_t req_set_mode = 0xA2;
+
+class LibusbBackend : public Backend
+{
+public:
+	~LibusbBackend() override
+	{
+		if (dev) {
+			libusb_release_interface(dev, 0);
+			libusb_close(dev);
+		}
+		if (ctx)
+			libusb_exit(ctx);
+	}
+
+	bool open(std::string &error) override
+	{
+		int r = libusb_init(&ctx);
+		if (r < 0) {
+			error = libusb_error_name(r);
+			return false;
+		}
+		dev = libusb_open_device_with_vid_pid(ctx, vid, pid);
+		if (!dev) {
+			error = "no device 0403:6001 found";
+			return false;
+		}
+		libusb_set_auto_detach_kernel_driver(dev, 1);
+		r = libusb_claim_interface(dev, 0);
+		if (r < 0) {
+			error = std::string("claim interface: ") + libusb_error_name(r);
+			return false;
+		}
+		return true;
+	}
+
+	bool set_latency(uint8_t ms) override
+	{
+		return control(req_set_latency_timer, ms, 0);
+	}
+
+	bool set_baud(uint32_t baud) override
+	{
+		uint32_t div = ftdi_baud_divisor(baud);
+		return control(req_set_baud_rate, div & 0xffff, div >> 16);
+	}
+
+	bool set_mode(uint8_t mode, uint16_t param) override
+	{
+		return control(req_set_mode, mode, param);
+	}
+
+	bool reset_timing() override
+	{
+		return control(req_reset_timing, 0, 0);
+	}
+
+	bool timing_count(uint8_t probe, unsigned &count) override
+	{
+		// min, max, count, then the buckets (little endian)
+		uint8_t h[6];
+		if (libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
+			| LIBUSB_ENDPOINT_IN, req_get_timing, 0, probe, h, sizeof(h), 1000) != sizeof(h))
+			return false;
+		count = h[4] | h[5] << 8;
+		return true;
+	}
+
+	int write(const uint8_t *buf, size_t len, int timeout_ms) override
+	{
+		int done = 0;
+		int r = libusb_bulk_transfer(dev, ep_out, (uint8_t *)buf, (int)len, &done, timeout_ms);
+		return r < 0 && r != LIBUSB_ERROR_TIMEOUT ? -1 : done;
+	}
+
+	int read(uint8_t *buf, size_t len, int timeout_ms) override
+	{
+		// Every IN packet starts with the modem and line status bytes
+		size_t got = std::min(len, pending.size());
+		memcpy(buf, pending.data(), got);
+		pending.erase(pending.begin(), pending.begin() + got);
+
+		uint64_t deadline = now_us() + (uint64_t)timeout_ms * 1000;
+		while (got < len) {
+			uint64_t now = now_us();
+			if (now >= deadline)
+				break;
+			uint8_t pkt[packet_size * 8];
+			int n = 0;
+			int r = libusb_bulk_transfer(dev, ep_in, pkt, sizeof(pkt), &n,
+				(unsigned)((deadline - now + 999) / 1000));
+			if (r < 0 && r != LIBUSB_ERROR_TIMEOUT)
+				return -1;
+			for (int p = 0; p < n; p += packet_size) {
+				int payload = std::min<int>(n - p, packet_size) - 2;
+				if (payload <= 0)
+					continue;
+				size_t take = std::min<size_t>(payload, len - got);
+				memcpy(buf + got, pkt + p + 2, take);
+				got += take;
+				// keep what the caller didn't ask for yet
+				pending.insert(pending.end(), pkt + p + 2 + take, pkt + p + 2 + payload);
+			}
+		}
+		return (int)got;
+	}
+
+	std::string name() const override { return "libusb"; }
+
+private:
+	bool control(uint8_t request, uint16_t value, uint16_t index)
+	{
+		return libusb_control_transfer(dev, LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE
+			| LIBUSB_ENDPOINT_OUT, request, value, index, nullptr, 0, 1000) >= 0;
+	}
+
+	std::vector<uint8_t> pending;
+	libusb_context *ctx = nullptr;
+	libusb_device_handle *dev = nullptr;
+};
+
+} // namespace
+
+Backend *make_libusb_backend()
+{
+	return new LibusbBackend;
+}
+
+#else
+
+Backend *make_libusb_backend()
+{
+	return nullptr;
+}
+
+#endif
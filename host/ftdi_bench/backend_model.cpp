@@ -0,0 +1,122 @@
+// Model of the firmware in loopback mode.
+//
+// The clock is virtual, so runs are fast and the numbers are reproducible.
+// What is modelled:
+//  - USB full speed: 1 ms frames with room for at most 19 bulk packets, and a
+//    transfer completes to the application at the end of the frame that carried
+//    its last packet
+//  - OUT transfers are split in 64 byte packets, IN packets carry up to 62
+//    payload bytes (the firmware prefixes 2 status bytes)
+//  - the firmware sends a full IN packet as soon as it has 62 bytes, a short
+//    one only after the latency timer expired since the previous IN packet
+//    (bench_loopback and the UART bridge, see FtdiPersonality::in_packet_due)
+//  - the USART is bypassed, so the baud rate plays no part and isn't swept
+//  - the firmware loopback ring holds 128 bytes; the model doesn't stall OUT
+//    packets on it, which only matters for blocks much bigger than a frame
+
+#include "backend.h"
+#include <algorithm>
+#include <deque>
+
+namespace {
+
+const uint64_t frame_us = 1000;
+const unsigned packets_per_frame = 19;
+const size_t out_packet = 64;
+const size_t in_payload = 62;
+
+class ModelBackend : public Backend
+{
+public:
+	bool open(std::string &) override { return true; }
+	bool set_latency(uint8_t ms) override { latency_us = (ms ? ms : 1) * 1000ull; return true; }
+	bool set_baud(uint32_t) override { return true; }
+	bool set_mode(uint8_t mode, uint16_t) override { return mode == mode_loopback; }
+
+	int write(const uint8_t *buf, size_t len, int) override
+	{
+		size_t done = 0;
+		while (done < len) {
+			size_t n = std::min(out_packet, len - done);
+			uint64_t t = take_slot(clock_us);
+			for (size_t i = 0; i < n; i++)
+				ring.push_back({ buf[done + i], t });
+			done += n;
+		}
+		clock_us = frame_end(bus_us);
+		return (int)len;
+	}
+
+	int read(uint8_t *buf, size_t len, int timeout_ms) override
+	{
+		size_t got = 0;
+		uint64_t deadline = clock_us + (uint64_t)timeout_ms * 1000;
+		uint64_t done_us = clock_us;
+
+		while (got < len && !ring.empty()) {
+			// when does the firmware hand out the next packet
+			size_t n = std::min(in_payload, ring.size());
+			uint64_t release;
+			if (n == in_payload)
+				release = ring[n - 1].arrival;
+			else
+				release = std::max(ring.back().arrival, last_in_us + latency_us);
+			release = std::max(release, clock_us);
+
+			uint64_t t = take_slot(release);
+			if (frame_end(t) > deadline)
+				break;
+			last_in_us = t;
+			n = std::min(n, len - got);
+			for (size_t i = 0; i < n; i++) {
+				buf[got++] = ring.front().value;
+				ring.pop_front();
+			}
+			done_us = frame_end(t);
+		}
+		clock_us = got < len ? deadline : done_us;
+		return (int)got;
+	}
+
+	std::string name() const override { return "model"; }
+
+	uint64_t now_us() override { return clock_us; }
+
+private:
+	struct Byte
+	{
+		uint8_t value;
+		uint64_t arrival; // in the firmware ring
+	};
+
+	static uint64_t frame_end(uint64_t t) { return (t / frame_us + 1) * frame_us; }
+
+	// Time of the next free bulk slot at or after `t`
+	uint64_t take_slot(uint64_t t)
+	{
+		if (t > bus_us) {
+			bus_us = t;
+			slots = 0;
+		}
+		if (slots == packets_per_frame) {
+			bus_us = frame_end(bus_us);
+			slots = 0;
+		}
+		slots++;
+		return bus_us;
+	}
+
+	uint64_t clock_us = 0;
+	uint64_t bus_us = 0; // time of the last packet on the bus
+	unsigned slots = 0; // packets already in the frame of bus_us
+	uint64_t latency_us = 16000;
+	uint64_t last_in_us = 0;
+	std::deque<Byte> ring;
+};
+
+} // namespace
+
+Backend *make_model_backend()
+{
+	return new ModelBackend;
+}
@@ -0,0 +1,102 @@
+// Linux ftdi_sio tty backend.
+//
+// Only the regular USART bridge is reachable this way (no vendor requests), so
+// loopback measurements need TXD1 wired to RXD1. The latency timer is set
+// through sysfs, which usually needs root.
+
+#include "backend.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <asm/termbits.h> // termios2, <termios.h> clashes with it
+
+namespace {
+
+class TtyBackend : public Backend
+{
+public:
+	explicit TtyBackend(const std::string &p) : path(p) {}
+	~TtyBackend() override { if (fd >= 0) ::close(fd); }
+
+	bool open(std::string &error) override
+	{
+		fd = ::open(path.c_str(), O_RDWR | O_NOCTTY | O_NONBLOCK);
+		if (fd < 0) {
+			error = path + ": " + strerror(errno);
+			return false;
+		}
+		return set_baud(115200);
+	}
+
+	bool set_latency(uint8_t ms) override
+	{
+		// /dev/ttyUSB0 -> /sys/bus/usb-serial/devices/ttyUSB0/latency_timer
+		std::string dev = path.substr(path.rfind('/') + 1);
+		FILE *f = fopen(("/sys/bus/usb-serial/devices/" + dev + "/latency_timer").c_str(), "w");
+		if (!f)
+			return false;
+		fprintf(f, "%u\n", ms);
+		return fclose(f) == 0;
+	}
+
+	bool set_baud(uint32_t baud) override
+	{
+		// termios2 allows arbitrary rates, ftdi_sio works out the divisor
+		struct termios2 t;
+		if (ioctl(fd, TCGETS2, &t) < 0)
+			return false;
+		t.c_iflag = 0;
+		t.c_oflag = 0;
+		t.c_lflag = 0;
+		t.c_cflag = CS8 | CREAD | CLOCAL | BOTHER;
+		t.c_ispeed = t.c_ospeed = baud;
+		return ioctl(fd, TCSETS2, &t) == 0;
+	}
+
+	bool set_mode(uint8_t mode, uint16_t) override { return mode == mode_uart; }
+
+	int write(const uint8_t *buf, size_t len, int timeout_ms) override
+	{
+		return io(true, (uint8_t *)buf, len, timeout_ms);
+	}
+
+	int read(uint8_t *buf, size_t len, int timeout_ms) override
+	{
+		return io(false, buf, len, timeout_ms);
+	}
+
+	std::string name() const override { return "tty:" + path; }
+
+private:
+	int io(bool out, uint8_t *buf, size_t len, int timeout_ms)
+	{
+		size_t done = 0;
+		while (done < len) {
+			struct pollfd p = { fd, (short)(out ? POLLOUT : POLLIN), 0 };
+			int r = poll(&p, 1, timeout_ms);
+			if (r < 0)
+				return -1;
+			if (r == 0)
+				break;
+			ssize_t n = out ? ::write(fd, buf + done, len - done) : ::read(fd, buf + done, len - done);
+			if (n < 0)
+				return -1;
+			done += n;
+		}
+		return (int)done;
+	}
+
+	std::string path;
+	int fd = -1;
+};
+
+} // namespace
+
+Backend *make_tty_backend(const std::string &path)
+{
+	return new TtyBackend(path);
+}
@@ -0,0 +1,14 @@
+#include "backend.h"
+
+uint32_t ftdi_baud_divisor(uint32_t baud)
+{
+	// Divisor of the 3 MHz base clock in 1/8 steps, the fraction has an odd encoding
+	static const uint8_t frac_code[8] = { 0, 3, 2, 4, 1, 5, 6, 7 };
+	uint32_t div8 = (3000000 * 8 + baud / 2) / baud;
+
+	if (div8 == 8)
+		return 0; // 3 Mbaud
+	if (div8 == 12)
+		return 1; // 2 Mbaud
+	return (div8 >> 3) | ((uint32_t)frac_code[div8 & 7] << 14);
+}
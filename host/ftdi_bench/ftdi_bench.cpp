@@ -0,0 +1,279 @@
+// ftdi_bench
+//
+// Throughput and round trip latency of the emulated FTDI device.
+//
+// For every combination of transfer size, latency timer and baud rate, blocks of
+// `size` bytes are sent and read back `iterations` times. The echo comes from
+// the firmware loopback mode (--mode fw-loopback, libusb and model backends)
+// or from a wire between TXD1 and RXD1 (--mode uart-loopback). Reported are
+// the one way payload rate in MB/s and the round trip latency percentiles.
+// The firmware loopback bypasses the USART, so --baud only applies to
+// uart-loopback and the baud column shows '-' otherwise (0 in the CSV/JSON files).
+// With a Debug firmware the libusb backend also reports, per baud rate, how
+// many polled USART bursts ran (uart-loopback): none below 500 kbaud.
+//
+// Backends:
+//   model            in-process model of the firmware, no board needed (CI)
+//   libusb           direct USB access, needs a build with libusb-1.0
+//   tty:/dev/ttyUSB0 the kernel ftdi_sio driver
+//
+// Usage:
+//   ftdi_bench [--backend model|libusb|tty:PATH] [--mode fw-loopback|uart-loopback]
+//              [--sizes 1,62,64,512,4096] [--latency 1,2,16] [--baud 115200]
+//              [--iterations 50] [--timeout 1000] [--csv FILE] [--json FILE]
+
+#include "backend.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct Result
+{
+	uint32_t baud;
+	unsigned latency_ms;
+	size_t size;
+	unsigned iterations;
+	unsigned errors; // blocks that came back short or corrupted
+	double mbps;
+	double p50_us, p90_us, p99_us, max_us;
+};
+
+std::vector<unsigned long> parse_list(const char *s)
+{
+	std::vector<unsigned long> v;
+	while (*s) {
+		char *end;
+		v.push_back(strtoul(s, &end, 0));
+		if (end == s)
+			break;
+		s = *end == ',' ? end + 1 : end;
+	}
+	return v;
+}
+
+double percentile(std::vector<double> sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	size_t i = (size_t)(p / 100 * (sorted.size() - 1) + 0.5);
+	return sorted[i];
+}
+
+// Sends one block and reads the echo, returns true if it came back intact
+bool round_trip(Backend &b, const std::vector<uint8_t> &out, std::vector<uint8_t> &in,
+	int timeout_ms, bool threaded)
+{
+	int written = 0, got = 0;
+	if (threaded) {
+		// the device only buffers a few packets, so read while writing
+		std::thread writer([&] { written = b.write(out.data(), out.size(), timeout_ms); });
+		got = b.read(in.data(), in.size(), timeout_ms);
+		writer.join();
+	} else {
+		written = b.write(out.data(), out.size(), timeout_ms);
+		got = b.read(in.data(), in.size(), timeout_ms);
+	}
+	return written == (int)out.size() && got == (int)in.size() && in == out;
+}
+
+Result measure(Backend &b, uint32_t baud, unsigned latency, size_t size, unsigned iterations,
+	int timeout_ms, bool threaded)
+{
+	Result r = {};
+	r.baud = baud;
+	r.latency_ms = latency;
+	r.size = size;
+	r.iterations = iterations;
+
+	std::vector<uint8_t> out(size), in(size);
+	std::vector<double> rtt;
+	uint64_t total_us = 0;
+
+	for (unsigned it = 0; it < iterations; it++) {
+		for (size_t i = 0; i < size; i++)
+			out[i] = (uint8_t)(i * 7 + it);
+		uint64_t t0 = b.now_us();
+		bool ok = round_trip(b, out, in, timeout_ms, threaded);
+		uint64_t dt = b.now_us() - t0;
+		total_us += dt;
+		if (!ok) {
+			r.errors++;
+			// drop whatever is still on its way back before the next block
+			std::vector<uint8_t> junk(4096);
+			while (b.read(junk.data(), junk.size(), 50) > 0) {}
+			continue;
+		}
+		rtt.push_back((double)dt);
+	}
+
+	std::sort(rtt.begin(), rtt.end());
+	if (total_us)
+		r.mbps = (double)size * (iterations - r.errors) / total_us; // bytes/us == MB/s
+	r.p50_us = percentile(rtt, 50);
+	r.p90_us = percentile(rtt, 90);
+	r.p99_us = percentile(rtt, 99);
+	r.max_us = rtt.empty() ? 0 : rtt.back();
+	return r;
+}
+
+void write_csv(FILE *f, const std::vector<Result> &results)
+{
+	fprintf(f, "baud,latency_ms,size,iterations,errors,mbps,p50_us,p90_us,p99_us,max_us\n");
+	for (const Result &r : results)
+		fprintf(f, "%u,%u,%zu,%u,%u,%.4f,%.0f,%.0f,%.0f,%.0f\n", r.baud, r.latency_ms, r.size,
+			r.iterations, r.errors, r.mbps, r.p50_us, r.p90_us, r.p99_us, r.max_us);
+}
+
+void write_json(FILE *f, const std::string &backend, const std::vector<Result> &results)
+{
+	fprintf(f, "{\n  \"backend\": \"%s\",\n  \"results\": [\n", backend.c_str());
+	for (size_t i = 0; i < results.size(); i++) {
+		const Result &r = results[i];
+		fprintf(f, "    {\"baud\": %u, \"latency_ms\": %u, \"size\": %zu, \"iterations\": %u, "
+			"\"errors\": %u, \"mbps\": %.4f, \"p50_us\": %.0f, \"p90_us\": %.0f, "
+			"\"p99_us\": %.0f, \"max_us\": %.0f}%s\n", r.baud, r.latency_ms, r.size,
+			r.iterations, r.errors, r.mbps, r.p50_us, r.p90_us, r.p99_us, r.max_us,
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+bool write_file(const char *path, const std::string &backend, const std::vector<Result> &results,
+	bool json)
+{
+	FILE *f = fopen(path, "w");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+	if (json)
+		write_json(f, backend, results);
+	else
+		write_csv(f, results);
+	return fclose(f) == 0;
+}
+
+void usage()
+{
+	fprintf(stderr,
+		"usage: ftdi_bench [--backend model|libusb|tty:PATH] [--mode fw-loopback|uart-loopback]\n"
+		"                  [--sizes LIST] [--latency LIST] [--baud LIST] [--iterations N]\n"
+		"                  [--timeout MS] [--csv FILE] [--json FILE]\n");
+	exit(2);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	std::string backend_name = "model";
+	bool fw_loopback = true;
+	std::vector<unsigned long> sizes = { 1, 62, 64, 512, 4096 };
+	std::vector<unsigned long> latencies = { 1, 2, 16 };
+	std::vector<unsigned long> bauds = { 115200 };
+	unsigned iterations = 50;
+	int timeout_ms = 1000;
+	const char *csv = nullptr, *json = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		std::string a = argv[i];
+		if (i + 1 >= argc)
+			usage();
+		const char *v = argv[++i];
+		if (a == "--backend")
+			backend_name = v;
+		else if (a == "--mode" && !strcmp(v, "fw-loopback"))
+			fw_loopback = true;
+		else if (a == "--mode" && !strcmp(v, "uart-loopback"))
+			fw_loopback = false;
+		else if (a == "--sizes")
+			sizes = parse_list(v);
+		else if (a == "--latency")
+			latencies = parse_list(v);
+		else if (a == "--baud")
+			bauds = parse_list(v);
+		else if (a == "--iterations")
+			iterations = atoi(v);
+		else if (a == "--timeout")
+			timeout_ms = atoi(v);
+		else if (a == "--csv")
+			csv = v;
+		else if (a == "--json")
+			json = v;
+		else
+			usage();
+	}
+
+	std::unique_ptr<Backend> b;
+	if (backend_name == "model")
+		b.reset(make_model_backend());
+	else if (backend_name == "libusb")
+		b.reset(make_libusb_backend());
+	else if (backend_name.compare(0, 4, "tty:") == 0)
+		b.reset(make_tty_backend(backend_name.substr(4)));
+	if (!b) {
+		fprintf(stderr, "ftdi_bench: backend '%s' not available\n", backend_name.c_str());
+		return 2;
+	}
+
+	std::string error;
+	if (!b->open(error)) {
+		fprintf(stderr, "ftdi_bench: %s: %s\n", b->name().c_str(), error.c_str());
+		return 1;
+	}
+	if (!b->set_mode(fw_loopback ? mode_loopback : mode_uart, 0)) {
+		fprintf(stderr, "ftdi_bench: %s can't do %s\n", b->name().c_str(),
+			fw_loopback ? "fw-loopback" : "uart-loopback");
+		return 1;
+	}
+
+	// the baud rate makes no difference without the USART
+	if (fw_loopback)
+		bauds = { 0 };
+
+	// the model has no concurrency, its writes never block
+	bool threaded = b->name() != "model";
+
+	std::vector<Result> results;
+	printf("%9s %7s %6s %6s %9s %8s %8s %8s %8s\n", "baud", "latency", "size", "errors",
+		"MB/s", "p50[us]", "p90[us]", "p99[us]", "max[us]");
+	for (unsigned long baud : bauds) {
+		if (baud && !b->set_baud(baud)) {
+			fprintf(stderr, "ftdi_bench: can't set %lu baud\n", baud);
+			return 1;
+		}
+		bool timing = b->reset_timing();
+		for (unsigned long latency : latencies) {
+			if (!b->set_latency(latency))
+				fprintf(stderr, "ftdi_bench: can't set the latency timer to %lu ms\n", latency);
+			for (unsigned long size : sizes) {
+				Result r = measure(*b, baud, latency, size, iterations, timeout_ms, threaded);
+				printf("%9s %7u %6zu %6u %9.4f %8.0f %8.0f %8.0f %8.0f\n",
+					baud ? std::to_string(baud).c_str() : "-", r.latency_ms, r.size, r.errors,
+					r.mbps, r.p50_us, r.p90_us, r.p99_us, r.max_us);
+				results.push_back(r);
+			}
+		}
+		unsigned rx_bursts, tx_bursts;
+		if (timing && b->timing_count(probe_uart_rx_burst, rx_bursts)
+			&& b->timing_count(probe_uart_tx_burst, tx_bursts))
+			printf("%9lu polled bursts: rx %u, tx %u\n", baud, rx_bursts, tx_bursts);
+	}
+
+	if (csv && !write_file(csv, b->name(), results, false))
+		return 1;
+	if (json && !write_file(json, b->name(), results, true))
+		return 1;
+
+	unsigned errors = 0;
+	for (const Result &r : results)
+		errors += r.errors;
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,8 @@
+// Host stand-in for <avr/io.h>: regs.h only needs _BV, the registers
+// themselves map onto host_sfr (see regs.h).
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#define _BV(bit) (1 << (bit))
+
+#endif
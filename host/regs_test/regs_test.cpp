@@ -0,0 +1,128 @@
+// regs_test
+//
+// Checks the typed register access layer (avr_ftdi_test/regs.h) on the host,
+// where the registers map onto the host_sfr array: bv() masks, and that
+// set/clear/modify merge their masks into one update that leaves the other
+// bits alone.
+//
+// Usage:
+//   regs_test            prints every failed check, exits with 1 if there was one
+
+#include "regs.h"
+
+#include <stdio.h>
+#include <thread>
+
+volatile uint8_t host_sfr[0x100];
+
+namespace {
+
+unsigned failures;
+
+void check(bool ok, const char *what, unsigned got, unsigned want)
+{
+	if (ok)
+		return;
+	failures++;
+	printf("FAIL %s: 0x%02x, expected 0x%02x\n", what, got, want);
+}
+
+#define CHECK_EQ(EXPR, WANT) check((unsigned)(EXPR) == (unsigned)(WANT), #EXPR, (unsigned)(EXPR), (unsigned)(WANT))
+
+// Masks are compile time constants
+static_assert(bv() == 0, "empty mask");
+static_assert(bv(0) == 0x01, "single bit");
+static_assert(bv(7, 0) == 0x81, "two bits");
+static_assert(bv(1, 1, 3) == 0x0a, "repeated bit");
+static_assert(Reg_UEINTX::addr == 0xE8, "address");
+
+void test_write_read()
+{
+	Reg_UENUM::write(0x5a);
+	CHECK_EQ(host_sfr[0xE9], 0x5a);
+	CHECK_EQ(Reg_UENUM::read(), 0x5a);
+}
+
+void test_set_clear()
+{
+	Reg_PORTB::write(0x10);
+	Reg_PORTB::set<bv(0, 7)>();
+	CHECK_EQ(Reg_PORTB::read(), 0x91);
+
+	Reg_PORTB::clear<bv(4, 7)>();
+	CHECK_EQ(Reg_PORTB::read(), 0x01);
+
+	// Setting/clearing bits that are already so changes nothing
+	Reg_PORTB::set<bv(0)>();
+	Reg_PORTB::clear<bv(6)>();
+	CHECK_EQ(Reg_PORTB::read(), 0x01);
+}
+
+void test_modify()
+{
+	Reg_UDIEN::write(0xf0);
+	Reg_UDIEN::modify<bv(4, 5), bv(0, 1)>();
+	CHECK_EQ(Reg_UDIEN::read(), 0xc3);
+
+	// A bit in both masks ends up set
+	Reg_UDIEN::modify<bv(0), bv(0)>();
+	CHECK_EQ(Reg_UDIEN::read(), 0xc3);
+}
+
+void test_any()
+{
+	Reg_UEINTX::write(0x04);
+	CHECK_EQ(Reg_UEINTX::any<bv(2)>(), true);
+	CHECK_EQ(Reg_UEINTX::any<bv(0, 2)>(), true);
+	CHECK_EQ(Reg_UEINTX::any<bv(0, 1)>(), false);
+}
+
+void test_wait()
+{
+	// Returns at once when a bit is set already
+	Reg_PLLCSR::write(0x01);
+	Reg_PLLCSR::wait<bv(0)>();
+
+	// Spins until another thread sets one of the bits, like the hardware would
+	Reg_PLLCSR::write(0);
+	std::thread t([] { Reg_PLLCSR::set<bv(1)>(); });
+	Reg_PLLCSR::wait<bv(0, 1)>();
+	t.join();
+	CHECK_EQ(Reg_PLLCSR::read(), 0x02);
+}
+
+// Registers don't overlap: an access touches its own address only
+void test_isolation()
+{
+	for (unsigned i = 0; i < sizeof(host_sfr); i++)
+		host_sfr[i] = 0;
+	Reg_UEDATX::write(0xff);
+	Reg_UEBCLX::set<bv(3)>();
+
+	unsigned others = 0;
+	for (unsigned i = 0; i < sizeof(host_sfr); i++)
+		if (i != 0xF1 && i != 0xF2)
+			others |= host_sfr[i];
+	CHECK_EQ(others, 0);
+	CHECK_EQ(host_sfr[0xF1], 0xff);
+	CHECK_EQ(host_sfr[0xF2], 0x08);
+}
+
+} // namespace
+
+int main()
+{
+	test_write_read();
+	test_set_clear();
+	test_modify();
+	test_any();
+	test_wait();
+	test_isolation();
+
+	if (failures) {
+		printf("%u check(s) failed\n", failures);
+		return 1;
+	}
+	printf("regs_test: all checks passed\n");
+	return 0;
+}
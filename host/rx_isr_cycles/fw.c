@@ -0,0 +1,28 @@
+// Test firmware of rx_isr_cycles: the receive path of the USART bridge on its
+// own, built like the Release firmware (NDEBUG, so with the naked RX interrupt).
+// The simulator gives it commands through GPIOR1, see rx_isr_cycles.cpp.
+
+#include "settings.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "uart.h"
+
+#define CMD_GAP 1 // framed mode, 100 us idle gap
+#define CMD_DRAIN 2 // empty the receive ring
+
+int main(void)
+{
+	USART_Init(1000000);
+	sei();
+
+	for (;;) {
+		uint8_t cmd = GPIOR1;
+
+		if (cmd == CMD_GAP)
+			uart_set_gap(100);
+		else if (cmd == CMD_DRAIN)
+			uart_rx_skip(uart_rx_head());
+		if (cmd)
+			GPIOR1 = 0;
+	}
+}
@@ -0,0 +1,153 @@
+// rx_isr_cycles
+//
+// Checks the cycle table of the naked USART1 RX interrupt (avr_ftdi_test/uart.c)
+// in simavr. The test firmware (fw.c) is the receive path of the USART bridge
+// on its own. Bytes go in through the simulated USART1, and every run of the
+// interrupt is timed from its vector to the instruction after reti, which is
+// what the table counts.
+//
+// Cases: a stored byte, a byte into the full ring, a byte in framed mode and
+// the first byte after an idle gap in framed mode. The 9-bit paths aren't
+// covered, simavr doesn't model the ninth bit.
+//
+// Usage:
+//   rx_isr_cycles fw.elf     prints the cycles per case, exits with 1 if one
+//                            differs from the table
+
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_uart.h>
+
+#include <stdio.h>
+
+namespace {
+
+// The table in uart.c, from the vector
+const unsigned cycles_stored = 62;
+const unsigned cycles_full = 66;
+const unsigned cycles_framed = cycles_stored + 6;
+const unsigned cycles_gap = cycles_framed + 34;
+
+const unsigned rx_vector = 25; // USART1_RX_vect_num
+const uint16_t gpior1 = 0x4a; // data space address, the test firmware's command register
+const uint16_t opcode_reti = 0x9518;
+const uint32_t f_cpu = 16000000;
+
+// Commands of the test firmware
+const uint8_t cmd_gap = 1;
+const uint8_t cmd_drain = 2;
+
+avr_t *avr;
+avr_irq_t *uart_in;
+unsigned failures;
+
+bool step()
+{
+	int state = avr_run(avr);
+	return state != cpu_Done && state != cpu_Crashed;
+}
+
+void run_for_us(unsigned us)
+{
+	avr_cycle_count_t end = avr->cycle + (avr_cycle_count_t)us * (f_cpu / 1000000);
+	while (avr->cycle < end && step()) {}
+}
+
+// Runs until the firmware has taken command `cmd`
+void command(uint8_t cmd)
+{
+	avr->data[gpior1] = cmd;
+	while (avr->data[gpior1] && step()) {}
+}
+
+// Sends `c` and returns the cycles its RX interrupt took, 0 if it never ran
+unsigned receive(uint8_t c)
+{
+	avr_raise_irq(uart_in, c);
+
+	avr_cycle_count_t start = 0;
+	for (unsigned n = 0; n < 100000 && step(); n++) {
+		if (!start) {
+			if (avr->pc == rx_vector * avr->vector_size)
+				start = avr->cycle;
+			continue;
+		}
+		uint16_t op = avr->flash[avr->pc] | avr->flash[avr->pc + 1] << 8;
+		if (op == opcode_reti) {
+			step();
+			return (unsigned)(avr->cycle - start);
+		}
+	}
+	return 0;
+}
+
+void check(const char *what, unsigned got, unsigned want)
+{
+	printf("%-28s %4u cycles", what, got);
+	if (got == want) {
+		printf("\n");
+		return;
+	}
+	failures++;
+	printf(", table says %u: FAIL\n", want);
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+	if (argc != 2) {
+		fprintf(stderr, "usage: rx_isr_cycles fw.elf\n");
+		return 2;
+	}
+
+	elf_firmware_t fw = {};
+	if (elf_read_firmware(argv[1], &fw)) {
+		fprintf(stderr, "rx_isr_cycles: can't read %s\n", argv[1]);
+		return 2;
+	}
+	avr = avr_make_mcu_by_name("atmega32u4");
+	if (!avr) {
+		fprintf(stderr, "rx_isr_cycles: simavr has no atmega32u4\n");
+		return 2;
+	}
+	avr_init(avr);
+	fw.frequency = f_cpu;
+	avr_load_firmware(avr, &fw);
+
+	// Don't echo what the USART sends on stdout
+	uint32_t flags = 0;
+	avr_ioctl(avr, AVR_IOCTL_UART_GET_FLAGS('1'), &flags);
+	flags &= ~AVR_UART_FLAG_STDIO;
+	avr_ioctl(avr, AVR_IOCTL_UART_SET_FLAGS('1'), &flags);
+	uart_in = avr_io_getirq(avr, AVR_IOCTL_UART_GETIRQ('1'), UART_IRQ_INPUT);
+
+	// Up to the main loop
+	run_for_us(1000);
+
+	check("byte stored", receive(0x55), cycles_stored);
+
+	// The ring holds 255 bytes, one is in already
+	unsigned worst = 0;
+	for (unsigned i = 1; i < 255; i++) {
+		unsigned c = receive((uint8_t)i);
+		worst = c > worst ? c : worst;
+	}
+	check("byte stored (slowest of 254)", worst, cycles_stored);
+	check("ring full", receive(0xaa), cycles_full);
+
+	command(cmd_drain);
+	command(cmd_gap);
+	check("framed mode", receive(0x01), cycles_framed);
+	// Twice the gap, so OCF3A is set when the next byte comes
+	run_for_us(200);
+	check("framed, after an idle gap", receive(0x02), cycles_gap);
+
+	if (failures) {
+		printf("%u case(s) differ from the table in uart.c\n", failures);
+		return 1;
+	}
+	printf("rx_isr_cycles: the RX interrupt matches the table\n");
+	return 0;
+}
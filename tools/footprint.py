@@ -0,0 +1,281 @@
+#!/usr/bin/env python3
+#
+# footprint.py
+#
+# Flash/RAM/stack footprint report for the avr_ftdi_test firmware.
+#
+# Reports:
+#  - totals: flash (.text + .data initializers) and RAM (.data + .bss + .noinit)
+#  - per module (object file): .text, .data, .bss and .progmem bytes
+#  - per symbol: the biggest symbols, with the section class they live in
+#  - worst case stack depth of main() and of every ISR, found by walking the
+#    static call graph of the disassembled ELF file. An ISR that executes sei
+#    (USB_GEN, see UsbDevice<>::gen_isr) can have any other ISR nest on top of
+#    it, so the worst case is main() plus the deepest such pair.
+#
+# When a budget file is given, every exceeded limit is reported and the script
+# exits with status 1, which fails the build (see the PostBuildEvent in
+# avr_ftdi_test.cppproj).
+#
+# Budget file format, one limit per line (bytes), '#' starts a comment:
+#   flash  28672
+#   ram    2048
+#   stack  512        # main() path + deepest ISR, with nesting
+#   sram   2432       # ram + stack
+#   module.avr_ftdi.o.bss  512
+#
+# Usage:
+#   footprint.py --elf Debug/avr_ftdi_test.elf --objdir Debug
+#                [--budget footprint_budget.cfg] [--top 25] [--prefix avr-]
+#
+# Only needs python 3 and the avr binutils (avr-objdump, avr-c++filt) on the PATH.
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+# Bytes pushed by a call/rcall and by an interrupt (22 bit PC devices would need 3)
+RETURN_ADDRESS_SIZE = 2
+
+
+def run(tool, *args):
+    return subprocess.run([tool] + list(args), check=True, stdout=subprocess.PIPE,
+                          universal_newlines=True).stdout
+
+
+def section_class(name):
+    """Maps a section name onto the classes we report"""
+    if name.startswith('.progmem'):
+        return 'progmem'
+    if name.startswith('.text') or name.startswith('.vectors') or name.startswith('.init') \
+            or name.startswith('.fini') or name.startswith('.ctors') or name.startswith('.dtors') \
+            or name.startswith('.jumptables') or name.startswith('.trampolines'):
+        return 'text'
+    if name.startswith('.data') or name.startswith('.rodata'):
+        return 'data'
+    if name.startswith('.bss') or name.startswith('COMMON'):
+        return 'bss'
+    if name.startswith('.noinit'):
+        return 'noinit'
+    return None
+
+
+def section_sizes(objdump, path):
+    """Returns {class: bytes} for the allocated sections of an object/ELF file"""
+    sizes = {}
+    # Idx Name          Size      VMA       LMA       File off  Algn
+    pat = re.compile(r'^\s*\d+\s+(\S+)\s+([0-9a-fA-F]+)\s')
+    for line in run(objdump, '-h', path).splitlines():
+        m = pat.match(line)
+        if not m:
+            continue
+        cls = section_class(m.group(1))
+        if cls:
+            sizes[cls] = sizes.get(cls, 0) + int(m.group(2), 16)
+    return sizes
+
+
+def symbols(objdump, path):
+    """Returns [(size, class, name)] for the sized symbols of an object file"""
+    result = []
+    # 00000000 l     O .bss	00000002 head
+    pat = re.compile(r'^[0-9a-fA-F]+\s.{7}\s(\S+)\s+([0-9a-fA-F]+)\s+(.+)$')
+    for line in run(objdump, '-t', '-C', path).splitlines():
+        m = pat.match(line)
+        if not m:
+            continue
+        size = int(m.group(2), 16)
+        cls = section_class(m.group(1))
+        if size and cls:
+            result.append((size, cls, m.group(3).strip()))
+    return result
+
+
+def demangle(cxxfilt, names):
+    """Returns {name: demangled name}, the names unchanged if c++filt isn't there"""
+    names = sorted(names)
+    try:
+        out = subprocess.run([cxxfilt], check=True, input='\n'.join(names) + '\n',
+                             stdout=subprocess.PIPE, universal_newlines=True).stdout
+    except (OSError, subprocess.CalledProcessError):
+        return {n: n for n in names}
+    return dict(zip(names, out.splitlines()))
+
+
+def call_graph(objdump, elf):
+    """Disassembles the ELF file and returns {function: (frame bytes, callees, flags, sei)}.
+    The names are left mangled: demangled template names contain '<' and '>',
+    which objdump also puts around the symbol of a call target."""
+    funcs = {}
+    current = None
+    frame_lo = None
+    label = re.compile(r'^[0-9a-fA-F]+ <(.+)>:$')
+    call = re.compile(r'\s(?:r?call|r?jmp)\s.*<(.+?)(\+0x[0-9a-fA-F]+)?>$')
+    for line in run(objdump, '-d', elf).splitlines():
+        m = label.match(line)
+        if m:
+            current = m.group(1)
+            funcs[current] = [0, set(), set(), False]
+            frame_lo = None
+            continue
+        if current is None or '\t' not in line:
+            continue
+        insn = line.split('\t', 2)[-1].strip()
+        f = funcs[current]
+        # subi r28 / sbci r29 subtract a frame of 64 bytes and more from Y. The
+        # epilogue adds it back the same way, with a negative value.
+        sub = re.match(r'subi\s+r28,\s*0x([0-9a-fA-F]+)', insn)
+        sbc = re.match(r'sbci\s+r29,\s*0x([0-9a-fA-F]+)', insn)
+        if frame_lo is not None and not sbc:
+            f[0] += frame_lo
+        if sbc and frame_lo is not None:
+            size = frame_lo | int(sbc.group(1), 16) << 8
+            if size < 0x8000:
+                f[0] += size
+        frame_lo = int(sub.group(1), 16) if sub else None
+        if insn.startswith('push'):
+            f[0] += 1
+        elif insn.startswith('rcall\t.+0') or insn.startswith('rcall .+0'):
+            f[0] += RETURN_ADDRESS_SIZE  # gcc's way of allocating 2 bytes of frame
+        elif re.match(r'sbiw\s+r28,\s*0x([0-9a-fA-F]+)', insn):
+            f[0] += int(re.match(r'sbiw\s+r28,\s*0x([0-9a-fA-F]+)', insn).group(1), 16)
+        elif insn.startswith('icall') or insn.startswith('eicall'):
+            f[2].add('indirect')
+        elif insn == 'sei':
+            f[3] = True
+        m = call.search(' ' + insn)
+        if m and m.group(2) is None and m.group(1) != current:
+            # a jump into the start of another function is a tail call
+            f[1].add(m.group(1))
+    return funcs
+
+
+def worst_stack(funcs, root, names, path=()):
+    """Worst case stack usage below `root` (including its own frame). Notes
+    explain why a figure is only a lower bound."""
+    name = names.get(root, root)
+    if root in path:
+        return 0, ['recursion: ' + ' -> '.join(names.get(p, p) for p in path + (root,))]
+    if root not in funcs:
+        return 0, ['%s: unknown callee' % name]
+    frame, callees, flags, _ = funcs[root]
+    notes = ['%s: %s call' % (name, fl) for fl in sorted(flags)]
+    deepest = 0
+    for c in sorted(callees):
+        depth, n = worst_stack(funcs, c, names, path + (root,))
+        notes += n
+        deepest = max(deepest, RETURN_ADDRESS_SIZE + depth)
+    return frame + deepest, notes
+
+
+def enables_interrupts(funcs, root, path=()):
+    """True if `root` or anything it calls executes sei"""
+    if root in path or root not in funcs:
+        return False
+    _, callees, _, sei = funcs[root]
+    return sei or any(enables_interrupts(funcs, c, path + (root,)) for c in callees)
+
+
+def read_budget(path):
+    budget = {}
+    with open(path) as f:
+        for line in f:
+            line = line.split('#', 1)[0].split()
+            if len(line) == 2:
+                budget[line[0]] = int(line[1], 0)
+    return budget
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Flash/RAM/stack footprint report')
+    ap.add_argument('--elf', required=True)
+    ap.add_argument('--objdir', required=True, help='directory with the object files')
+    ap.add_argument('--budget', help='budget file, exceeding a limit fails the build')
+    ap.add_argument('--top', type=int, default=25, help='number of symbols to list')
+    ap.add_argument('--prefix', default='avr-', help='binutils prefix')
+    args = ap.parse_args()
+
+    objdump = args.prefix + 'objdump'
+    measured = {}
+
+    total = section_sizes(objdump, args.elf)
+    measured['flash'] = total.get('text', 0) + total.get('progmem', 0) + total.get('data', 0)
+    measured['ram'] = total.get('data', 0) + total.get('bss', 0) + total.get('noinit', 0)
+    print('Total: flash %d bytes, RAM %d bytes (.data %d, .bss %d, .noinit %d)' % (
+        measured['flash'], measured['ram'], total.get('data', 0), total.get('bss', 0),
+        total.get('noinit', 0)))
+
+    print('\n%-24s %7s %7s %7s %8s' % ('module', '.text', '.data', '.bss', 'progmem'))
+    syms = []
+    objs = sorted(glob.glob(os.path.join(args.objdir, '*.o')))
+    for obj in objs:
+        name = os.path.basename(obj)
+        s = section_sizes(objdump, obj)
+        for cls, size in s.items():
+            measured['module.%s.%s' % (name, cls)] = size
+        print('%-24s %7d %7d %7d %8d' % (name, s.get('text', 0), s.get('data', 0),
+                                         s.get('bss', 0), s.get('progmem', 0)))
+        syms += [(size, cls, name, sym) for size, cls, sym in symbols(objdump, obj)]
+
+    print('\n%7s %-8s %-20s %s' % ('bytes', 'section', 'module', 'symbol'))
+    for size, cls, mod, sym in sorted(syms, reverse=True)[:args.top]:
+        print('%7d %-8s %-20s %s' % (size, cls, mod, sym))
+
+    funcs = call_graph(objdump, args.elf)
+    names = demangle(args.prefix + 'c++filt', funcs)
+    roots = ['main'] + sorted(f for f in funcs if re.match(r'__vector_\d+$', f))
+    print('\nWorst case stack depth:')
+    isrs = {}
+    bounds = 0
+    for r in roots:
+        depth, notes = worst_stack(funcs, r, names)
+        bounds += bool(notes)
+        nesting = ''
+        if r != 'main':
+            depth += RETURN_ADDRESS_SIZE  # the interrupted PC
+            isrs[r] = depth
+            if enables_interrupts(funcs, r):
+                nesting = ' (enables interrupts)'
+        else:
+            measured['stack.main'] = depth
+        print('  %-16s %4d bytes%s%s' % (r, depth, ' (lower bound)' if notes else '', nesting))
+        for n in sorted(set(notes)):
+            print('      ' + n)
+
+    # Only ISRs that enable interrupts can be interrupted, and the ones nesting
+    # on top of them don't (or they would count as such themselves)
+    deepest_isr = 0
+    for r, depth in isrs.items():
+        if enables_interrupts(funcs, r):
+            depth += max([d for o, d in isrs.items() if o != r] or [0])
+        deepest_isr = max(deepest_isr, depth)
+    measured['stack.isr'] = deepest_isr
+    measured['stack'] = measured.get('stack.main', 0) + deepest_isr
+    measured['sram'] = measured['ram'] + measured['stack']
+    print('  main + deepest ISR (nested): %d bytes%s' % (
+        measured['stack'], ' (lower bound, see the notes above)' if bounds else ''))
+    print('  static RAM + stack: %d bytes' % measured['sram'])
+
+    if not args.budget:
+        return 0
+
+    failed = 0
+    print('\nBudget (%s):' % args.budget)
+    for key, limit in sorted(read_budget(args.budget).items()):
+        used = measured.get(key, 0)
+        ok = used <= limit
+        failed += not ok
+        bound = bounds and key in ('stack', 'stack.main', 'stack.isr', 'sram')
+        print('  %-28s %6d / %6d %s%s' % (key, used, limit, 'ok' if ok else 'EXCEEDED',
+                                          ' (lower bound)' if bound else ''))
+    if failed:
+        print('footprint.py: error: %d budget limit(s) exceeded' % failed, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())